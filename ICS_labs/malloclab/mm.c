@@ -1,21 +1,53 @@
 /*
  * Use segregated free lists and LIFO strategy
- * Use first-fit strategy
- * Segregate into 16 classes, score wont be higher if more than 16
+ * Use two-level segregated fit (TLSF): 16 power-of-two classes,
+ *      each split into 4 linear sub-classes, 64 lists in total
+ * Two bitmaps record which lists are non-empty, so a class that
+ *      can hold the request is found by ctz instead of walking lists
+ * Lists of blocks from 4 KB on are treaps ordered by (size, address),
+ *      stored in the prev/next offsets as left/right, O(log n) best fit
  * Minimum block is 16 bytes : header + previous offset + next offset + footer
  * Use offset instead of address, result in higher utilization
+ *      compile with -DMM_HEAP64 to count offsets in 8-byte granules,
+ *      which lets the heap grow to 32 GB with the same 16-byte minimum block
  * Remove footer for allocated blocks, result in higher utilization
  * Chunksize: 1<<11 is better than 1<<12
+ * Large requests are mapped by themselves with mmap and unmapped on free
+ * Pages of large blank blocks are given back with madvise(MADV_DONTNEED),
+ *      mem_sbrk can not shrink the heap, so this is how the tail is trimmed
+ * Compile with -DMM_TRACE to log every call, replay the log with mm_replay
+ * mm_stats reports the shape of the heap, mm_checkheap prints it
+ * Deferred coalescing: freed blocks up to 72 bytes go to quick lists, one 
+ *      per size, still marked allocated; they are merged in a batch after
+ *      QUICK_BATCH frees, or when a request misses the free lists
+ * calloc skips the memset on memory known to be zero: the heap above 
+ *      zero_lo has never been written, or its pages were given back
+ * Large copies and fills use non-temporal stores, not to flush the cache
+ * The heap grows geometrically: each extension doubles the last one up to 
+ *      grow_max, and is at least grow_reqs requests of the average size;
+ *      mm_mallopt tunes this and the thresholds below
+ * Compile with -DMM_HARDEN to catch heap corruption where it happens:
+ *      every allocated block ends with a trailer holding its slack and a 
+ *      checksum of header and address, the slack starts with canary bytes;
+ *      freed blocks are poisoned and wait in a quarantine before reuse
  * 
  */
+#define _GNU_SOURCE     /* for mremap */
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
+#include "mm_ext.h"
 
 /* If you want debugging output, use the following macro.  When you hand
  * in, remove the #define DEBUG line. */
@@ -44,8 +76,63 @@
 /* Basic constants and macros */
 #define WSIZE 4     /* Word and header/footer size (bytes) */
 #define DSIZE 8     /* Double word size (bytes) */
-#define CHUNKSIZE (1 << 11)     /* Extend heap by this amount (bytes) */
+#define CHUNKSIZE (1 << 11)     /* Extend heap by at least this amount (bytes) */
+#define SBRK_MAX (1 << 30)  /* mem_sbrk takes an int, extend by this at most */
+#define MAX_BLKSIZE ((size_t)(~0x7U))  /* Largest size a header can hold */
+#define TRIM_THRESHOLD (1 << 17)    /* Give back pages of blank blocks this large */
+
+/* Copy and zero from this size on with non-temporal stores */
+#ifndef NT_THRESHOLD
+#define NT_THRESHOLD (1 << 17)
+#endif
+
+/* 1 if mem_sbrk hands out zeroed memory, as memlib's mapped heap does */
+#ifndef SBRK_ZERO
+#define SBRK_ZERO 1
+#endif
+
+/* Blocks up to this size go to quick lists, 0 to turn it off, QUICK_LIMIT at most */
+#define QUICK_LIMIT ((NQUICK + 1) * DSIZE)
+#ifndef QUICK_MAX
+#define QUICK_MAX QUICK_LIMIT
+#endif
+
+/* 
+ * mdriver scores utilization on small traces, -DDRIVER tunes for it
+ *      add -DMM_DEFAULTS to rename the functions but keep these settings
+ */
+#if defined(DRIVER) && !defined(MM_DEFAULTS)
+#define MM_SCORE
+#endif
+
+/* Requests from this size on are mapped by themselves, 0 to turn it off */
+#ifndef MMAP_THRESHOLD
+#ifdef MM_SCORE
+#define MMAP_THRESHOLD 0    /* mdriver wants every block inside the heap */
+#else
+#define MMAP_THRESHOLD (1 << 17)
+#endif
+#endif
+
+/* Largest extension of the heap, and how many average requests it should hold */
+#ifndef GROW_MAX
+#ifdef MM_SCORE
+#define GROW_MAX CHUNKSIZE  /* mdriver scores utilization, keep it fixed */
+#else
+#define GROW_MAX (1 << 20)
+#endif
+#endif
+#define GROW_REQS 16
 #define CSIZE 16    /* Use in Segregated free lists, seprated into CSIZE classes */
+#define SL_LOG2 2   /* Every class is split into (1 << SL_LOG2) sub-classes */
+#define SL_NUM (1 << SL_LOG2)
+#define NCLASS (CSIZE * SL_NUM)     /* Number of free lists */
+#define NQUICK 8    /* Quick lists, for blocks of 16, 24, ..., 72 bytes */
+#define NHEAD (NCLASS + NQUICK)     /* Head pointers before the prologue */
+#define QUICK_BATCH 128     /* Merge the quick blocks after this many frees */
+#define TREE_LOG 12     /* Lists of blocks from (1 << TREE_LOG) on are treaps */
+#define TREE_MIN (1 << TREE_LOG)
+#define TREE_CLASS ((TREE_LOG - SL_LOG2 - 2) * SL_NUM)  /* First treap list */
 
 #define MAX(x,y) ((x) > (y) ? (x) : (y))
 #define MIN(x,y) ((x) < (y) ? (x) : (y))
@@ -61,6 +148,14 @@
 #define GET_SIZE(p)    (GET(p) & ~0x7)
 #define GET_ALLOC(p)    (GET(p) & 0x1)
 #define GET_PREVALLOC(p)    (GET(p) & 0x2)
+#define GET_MMAPPED(p)  (GET(p) & 0x4)
+
+/* A mapped block: length of the mapping, padding, header, payload */
+#define MMAP_LEN(bp)    (*(size_t *)((char *)(bp) - 2 * DSIZE))
+
+/* Round p up or down to a page */
+#define PAGE_UP(p)  ((char *)(((size_t)(p) + getpagesize() - 1) & ~((size_t)getpagesize() - 1)))
+#define PAGE_DOWN(p)    ((char *)((size_t)(p) & ~((size_t)getpagesize() - 1)))
 
 /* Given block ptr bp, compute address of its header and footer */
 #define HDRP(bp)    ((char*)(bp) - WSIZE)
@@ -73,9 +168,58 @@
 /* The base pointer of the heap */
 static char* heap_listp = 0;
 
+/* Bit i of fl_bitmap: class i has a non-empty sub-class
+ * Bit (i * SL_NUM + j) of sl_bitmap: sub-class j of class i is non-empty
+ */
+static unsigned int fl_bitmap = 0;
+static unsigned long sl_bitmap = 0;
+
+/* Pages from trim_lo to the end of the heap are given back or never used */
+static char* trim_lo = 0;
+
+/* 
+ * The heap from zero_lo to the end is zero, except the footer of the last
+ *      blank block and the epilogue; heap_hiwater is the highest end so far,
+ *      memory below it may be dirty after mem_reset_brk
+ */
+static char* zero_lo = 0;
+static char* heap_hiwater = 0;
+
+/* Tunables, see mm_mallopt, they survive mm_init */
+static size_t quick_max = QUICK_MAX;
+static size_t mmap_threshold = MMAP_THRESHOLD;
+static size_t trim_threshold = TRIM_THRESHOLD;
+static size_t grow_min = CHUNKSIZE, grow_max = GROW_MAX, grow_reqs = GROW_REQS;
+
+/* Size of the next extension, and average of recent requests */
+static size_t grow_next = CHUNKSIZE;
+static size_t req_avg = 0;
+
+/* Counters for mm_stats */
+static unsigned long n_mallocs = 0, n_frees = 0;
+static unsigned long n_coalesces = 0, n_splits = 0, n_extends = 0;
+static size_t live_blocks = 0, mmap_blocks = 0, mmap_bytes = 0;
+static size_t peak_bytes = 0;   /* largest heap + mapped bytes */
+static size_t req_bytes = 0, granted_bytes = 0;
+
+/* Blocks waiting in quick lists */
+static unsigned int quick_count = 0;
+static size_t quick_bytes = 0;
+
+#define SL_BITS(fl)    ((unsigned int)((sl_bitmap >> ((fl) * SL_NUM)) & ((1 << SL_NUM) - 1)))
+
 /* Warning: next 3 macros save the offset, not the address 
  *      as they are only 4 bytes, not 8 bytes
+ * In 64-bit mode offsets count 8-byte granules instead of bytes,
+ *      always convert them with OFFSET and ADDR
  */
+#ifdef MM_HEAP64
+#define OFF_SHIFT 3
+#else
+#define OFF_SHIFT 0
+#endif
+#define OFFSET(bp)  ((unsigned int)(((char *)(bp) - heap_listp) >> OFF_SHIFT))
+#define ADDR(off)   (heap_listp + ((size_t)(off) << OFF_SHIFT))
 
 /* To find the head pointer of class n */
 #define GET_HEAD(n)    ((unsigned int)(GET(heap_listp + WSIZE * n)))
@@ -84,12 +228,96 @@ static char* heap_listp = 0;
 #define GET_PREVP(bp)    ((unsigned int)(GET(bp)))
 #define GET_NEXTP(bp)    ((unsigned int)(GET((char *)bp + WSIZE)))
 
+/* Quick lists are single linked, through the first word */
+#define QUICK_INDEX(size)   (((size) >> 3) - 2)
+#define GET_QHEAD(n)    GET(heap_listp + WSIZE * (NCLASS + (n)))
+#define SET_QHEAD(n, val)   PUT(heap_listp + WSIZE * (NCLASS + (n)), (val))
+
+/* Treap nodes reuse the same two words, t is an offset */
+#define LEFT(t)     GET_PREVP(ADDR(t))
+#define RIGHT(t)    GET_NEXTP(ADDR(t))
+#define SET_LEFT(t, val)    PUT(ADDR(t), (val))
+#define SET_RIGHT(t, val)   PUT(ADDR(t) + WSIZE, (val))
+#define TSIZE(t)    GET_SIZE(HDRP(ADDR(t)))
+
 static void * extend_heap(size_t words);
 static void * coalesce(void * bp);
 static void * find_fit(size_t size);
-static void * first_fit(size_t size);
-static void * best_fit(size_t size);
+static void * class_fit(size_t size);
+static int find_class(int index);
 static void place(void* ptr, size_t size);
+static size_t adjust_size(size_t size);
+static void * mmap_alloc(size_t size);
+static void trim(char * freed, size_t size, char * bp);
+static void consolidate(void);
+static size_t grow_size(size_t asize);
+static void copy_bytes(void * dst, const void * src, size_t n);
+static void zero_bytes(void * dst, size_t n);
+static void * malloc_block(size_t size);
+static void free_block(void * bp);
+static void release_block(char * bp);
+static void * realloc_block(void * oldptr, size_t size);
+static void * calloc_block(size_t nmemb, size_t size);
+
+#ifdef MM_TRACE
+#include <fcntl.h>
+#include <pthread.h>
+
+#define TRACE_RING 1024     /* Records buffered by every thread */
+
+static int trace_fd = -1;
+static uint64_t trace_seq = 0;
+static uint32_t trace_tids = 0;
+static __thread TRACE_REC trace_ring[TRACE_RING];
+static __thread int trace_n = 0;
+static __thread uint32_t trace_tid = 0;
+/* Rings that are not full go out when their thread or the process exits */
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+
+static void trace(int op, void * ptr, size_t size, void * ret);
+static void trace_setup(void);
+static void trace_exit(void * arg);
+static void trace_atexit(void);
+#define TRACE(op, ptr, size, ret)   trace(op, ptr, size, ret)
+#else
+#define TRACE(op, ptr, size, ret)
+#endif
+
+#ifdef MM_HARDEN
+#define HARDEN_SIZE DSIZE   /* Trailer: slack bytes, then checksum */
+#define CANARY_MAX 32       /* Slack bytes filled with CANARY and checked */
+#define POISON_MAX 64       /* Bytes of a quarantined block filled with POISON */
+#define CANARY 0xA5
+#define POISON 0xDD
+#ifndef QUARANTINE_MAX
+#define QUARANTINE_MAX (1 << 20)    /* Bytes of freed blocks held back */
+#endif
+
+/* The trailer is right before the next header */
+#define TRAILER(bp) (FTRP(bp) - WSIZE)
+/* The prev-alloc bit changes under the block, leave it out */
+#define CHECKSUM(bp, slack) \
+    ((((GET(HDRP(bp)) & ~0x2U) ^ (unsigned int)(uintptr_t)(bp) ^ \
+    ((unsigned int)(slack) * 0x9e3779b1U)) * 0x85ebca6bU) ^ harden_secret)
+#define HARDEN_SEAL(bp, size)   harden_seal(bp, size)
+
+static unsigned int harden_secret = 0;
+/* Quarantine, FIFO linked through the first word of the blocks */
+static char * q_head = 0;
+static char * q_tail = 0;
+static size_t q_bytes = 0;
+static size_t quarantine_max = QUARANTINE_MAX;
+
+static void harden_fail(void * bp, const char * what, const char * where);
+static size_t harden_check(char * bp, const char * where, int freed);
+static void harden_seal(char * bp, size_t size);
+static void quarantine(char * bp);
+static void quarantine_release(size_t keep);
+#else
+#define HARDEN_SIZE 0
+#define HARDEN_SEAL(bp, size)
+#endif
 
 
 /*
@@ -100,16 +328,44 @@ static void place(void* ptr, size_t size);
 int mm_init(void) {
     //printf("init..\n");
     //mm_checkheap(__func__);
-    if((heap_listp = mem_sbrk((4 + CSIZE) * WSIZE)) == (void*)(-1))   /* error */
+    if((heap_listp = mem_sbrk((4 + NHEAD) * WSIZE)) == (void*)(-1))   /* error */
         return -1;
    
-    for(int i = 0; i < CSIZE; i++){     /* allocate the space for head pointer*/
+    for(int i = 0; i < NHEAD; i++){     /* allocate the space for head pointer*/
         PUT(heap_listp + i * WSIZE, 0);
     }
-    PUT(heap_listp + CSIZE * WSIZE, 0);     /* Alignment padding */
-    PUT(heap_listp + ((1 + CSIZE) * WSIZE), PACK(DSIZE, 0x3));      /* Prologue header */
-    PUT(heap_listp + ((2 + CSIZE) * WSIZE), PACK(DSIZE, 0x3));      /* Prologue footer */
-    PUT(heap_listp + ((3 + CSIZE) * WSIZE), PACK(0, 0x3));          /* Epilogue header */
+    fl_bitmap = 0;
+    sl_bitmap = 0;
+    quick_count = 0;
+    quick_bytes = 0;
+    PUT(heap_listp + NHEAD * WSIZE, 0);     /* Alignment padding */
+    PUT(heap_listp + ((1 + NHEAD) * WSIZE), PACK(DSIZE, 0x3));      /* Prologue header */
+    PUT(heap_listp + ((2 + NHEAD) * WSIZE), PACK(DSIZE, 0x3));      /* Prologue footer */
+    PUT(heap_listp + ((3 + NHEAD) * WSIZE), PACK(0, 0x3));          /* Epilogue header */
+    trim_lo = heap_listp + ((4 + NHEAD) * WSIZE);
+    /* the links of the first blank block are written, everything after is clean */
+    zero_lo = SBRK_ZERO ? MAX(trim_lo + DSIZE, heap_hiwater) : (char *)UINTPTR_MAX;
+    heap_hiwater = MAX(heap_hiwater, (char *)mem_heap_hi() + 1);
+    n_mallocs = n_frees = n_coalesces = n_splits = n_extends = 0;
+    live_blocks = mmap_blocks = mmap_bytes = 0;
+    peak_bytes = mem_heapsize();
+    req_bytes = granted_bytes = 0;
+    grow_next = grow_min;
+    req_avg = 0;
+#ifdef MM_HARDEN
+    q_head = q_tail = 0;
+    q_bytes = 0;
+    /* not a secret to the process, only to a stray write */
+    if(harden_secret == 0)
+        harden_secret = ((unsigned int)(uintptr_t)&harden_secret ^ 
+            ((unsigned int)getpid() << 16) ^ (unsigned int)time(NULL)) | 1;
+#endif
+#ifdef MM_TRACE
+    /* trace the whole process without changing it */
+    char * path = getenv("MM_TRACE_FILE");
+    if(trace_fd < 0 && path != NULL)
+        mm_trace_start(open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+#endif
     //heap_listp += (2 * WSIZE);
     if(extend_heap(CHUNKSIZE / WSIZE) == NULL)  /* create a free block of CHUNKSIZE bytes */
         return -1;
@@ -117,81 +373,208 @@ int mm_init(void) {
 }
 
 /*
- * To find which class should this size be in
+ * To find which list should this size be in
+ *      class fl holds [2^(fl+4), 2^(fl+5)), split linearly into SL_NUM parts
+ *      sizes below 2^(SL_LOG2+3) all go to class 0, one list per 8 bytes
  */
 int head_match(size_t size){
-    int index;
-    for(index = 0; index < CSIZE - 1; index++){
-        if(size <= (unsigned long)(1 << (index + 4))){
-            return index;
-        }            
+    int fl, sl;
+    if(size < (1 << (SL_LOG2 + 3))){
+        fl = 0;
+        sl = size >> 3;
+    }
+    else{
+        int msb = 63 - __builtin_clzl(size);
+        fl = msb - (SL_LOG2 + 2);
+        sl = (size >> (msb - SL_LOG2)) & (SL_NUM - 1);
+        /* the last list holds everything larger */
+        if(fl >= CSIZE){
+            fl = CSIZE - 1;
+            sl = SL_NUM - 1;
+        }
+    }
+    return fl * SL_NUM + sl;
+}
+
+/*
+ * Find the first non-empty list from index on, -1 if there is none
+ *      two ctz instead of walking the lists
+ */
+static int find_class(int index){
+    int fl = index >> SL_LOG2;
+    unsigned int bits = SL_BITS(fl) & (~0U << (index & (SL_NUM - 1)));
+    if(!bits){
+        bits = fl_bitmap & (~0U << (fl + 1));
+        if(!bits)
+            return -1;
+        fl = __builtin_ctz(bits);
+        bits = SL_BITS(fl);
+    }
+    return fl * SL_NUM + __builtin_ctz(bits);
+}
+
+/*
+ * Priority of a treap node, a hash of its offset
+ *      no need to store it in the block
+ */
+static unsigned int tree_prio(unsigned int t){
+    t ^= t >> 16;
+    t *= 0x7feb352d;
+    t ^= t >> 15;
+    t *= 0x846ca68b;
+    t ^= t >> 16;
+    return t;
+}
+
+/*
+ * Order of treap nodes: by size, then by address
+ */
+static int tree_less(unsigned int a, unsigned int b){
+    return TSIZE(a) < TSIZE(b) || (TSIZE(a) == TSIZE(b) && a < b);
+}
+
+/*
+ * Insert node t into the treap, return the new root
+ */
+static unsigned int tree_insert(unsigned int root, unsigned int t){
+    unsigned int child;
+    if(!root)
+        return t;
+    if(tree_less(t, root)){
+        child = tree_insert(LEFT(root), t);
+        SET_LEFT(root, child);
+        /* rotate right */
+        if(tree_prio(child) > tree_prio(root)){
+            SET_LEFT(root, RIGHT(child));
+            SET_RIGHT(child, root);
+            return child;
+        }
+    }
+    else{
+        child = tree_insert(RIGHT(root), t);
+        SET_RIGHT(root, child);
+        /* rotate left */
+        if(tree_prio(child) > tree_prio(root)){
+            SET_RIGHT(root, LEFT(child));
+            SET_LEFT(child, root);
+            return child;
+        }
+    }
+    return root;
+}
+
+/*
+ * Merge two treaps, every node of a is less than every node of b
+ */
+static unsigned int tree_merge(unsigned int a, unsigned int b){
+    if(!a)
+        return b;
+    if(!b)
+        return a;
+    if(tree_prio(a) > tree_prio(b)){
+        SET_RIGHT(a, tree_merge(RIGHT(a), b));
+        return a;
     }
-    return index;
+    SET_LEFT(b, tree_merge(a, LEFT(b)));
+    return b;
+}
+
+/*
+ * Remove node t from the treap, return the new root
+ */
+static unsigned int tree_delete(unsigned int root, unsigned int t){
+    if(root == t)
+        return tree_merge(LEFT(t), RIGHT(t));
+    if(tree_less(t, root))
+        SET_LEFT(root, tree_delete(LEFT(root), t));
+    else
+        SET_RIGHT(root, tree_delete(RIGHT(root), t));
+    return root;
+}
+
+/*
+ * The smallest node not smaller than size, 0 if there is none
+ */
+static unsigned int tree_fit(unsigned int root, size_t size){
+    unsigned int fit = 0;
+    while(root){
+        if(TSIZE(root) >= size){
+            fit = root;
+            root = LEFT(root);
+        }
+        else
+            root = RIGHT(root);
+    }
+    return fit;
 }
 
 /*
  * To insert a new blank block, use LIFO strategy
+ *      large blocks go to the treap of their class instead
  */
 void insert(char * bp){
-    //printf("insert:%p\n",bp);
-    //mm_checkheap(__func__);
     size_t size = GET_SIZE(HDRP(bp));
     int index = head_match(size);
+    unsigned int offset = OFFSET(bp);
+    PUT(bp, 0);
+    PUT(bp + WSIZE, 0);
+    if(index >= TREE_CLASS){
+        PUT(heap_listp + index * WSIZE, tree_insert(GET_HEAD(index), offset));
+    }
     /* this block is the first in its class, then header should save its offset */
-    if(GET_HEAD(index) == 0){        
-        PUT(heap_listp + index * WSIZE, (unsigned int)(bp - heap_listp));
-        PUT(bp, 0);        
-        PUT(bp + WSIZE, 0);
+    else if(GET_HEAD(index) == 0){        
+        PUT(heap_listp + index * WSIZE, offset);
     }
     /* this class already has blocks, then this one should be the first */
     else{           
         PUT(bp + WSIZE, GET_HEAD(index));
-        PUT(heap_listp + GET_HEAD(index), (unsigned int)(bp - heap_listp));
-        PUT(bp, 0);
-        PUT(heap_listp + index * WSIZE, (unsigned int)(bp - heap_listp));
-    }
-    //printf("end\n");
-    /*for(int i = 0;i < CSIZE; i++){
-        char * tmp = heap_listp + GET_HEAD(i);
-        while(tmp > heap_listp){
-            printf("--%p\n",bp);
-            tmp = heap_listp + GET_NEXTP(tmp);
-        }
-        printf("--\n");
+        PUT(ADDR(GET_HEAD(index)), offset);
+        PUT(heap_listp + index * WSIZE, offset);
     }
-    printf("--------\n");*/
-    
+    /* this list is not empty any more */
+    sl_bitmap |= 1UL << index;
+    fl_bitmap |= 1U << (index >> SL_LOG2);
 }
 
 /*
  * To remove a block from the class
  */
 void delete(char * bp){
-    //printf("delete:%p\n",bp);
-    //mm_checkheap(__func__);
     if(bp == NULL)
         return;
     size_t size = GET_SIZE(HDRP(bp));
     int index = head_match(size);
+    if(index >= TREE_CLASS){
+        PUT(heap_listp + index * WSIZE, 
+            tree_delete(GET_HEAD(index), OFFSET(bp)));
+        if(GET_HEAD(index))
+            return;
+    }
     /* Case 1: has prev and next, need to connect prev and next */
-    if(GET_PREVP(bp) && GET_NEXTP(bp)){
-        PUT(heap_listp + GET_PREVP(bp) + WSIZE, GET_NEXTP(bp));
-        PUT(heap_listp + GET_NEXTP(bp), GET_PREVP(bp));
+    else if(GET_PREVP(bp) && GET_NEXTP(bp)){
+        PUT(ADDR(GET_PREVP(bp)) + WSIZE, GET_NEXTP(bp));
+        PUT(ADDR(GET_NEXTP(bp)), GET_PREVP(bp));
+        return;
     }
     /* Case 2: only has prev, just remove it as it is the last one */
     else if(GET_PREVP(bp) && !GET_NEXTP(bp)){
-        PUT(heap_listp + GET_PREVP(bp) + WSIZE, 0);
+        PUT(ADDR(GET_PREVP(bp)) + WSIZE, 0);
+        return;
     }
     /* Case 3: only has next, change the header as it is the first one */
     else if(!GET_PREVP(bp) && GET_NEXTP(bp)){
         PUT(heap_listp + index * WSIZE, GET_NEXTP(bp));
-        PUT(heap_listp + GET_NEXTP(bp), 0);
+        PUT(ADDR(GET_NEXTP(bp)), 0);
+        return;
     }
     /* Case 4: no prev or next, just remove it as it is the only ones */
     else{
         PUT(heap_listp + index * WSIZE, 0);
     }
-    //printf("end\n");
+    /* this list is empty now */
+    sl_bitmap &= ~(1UL << index);
+    if(!SL_BITS(index >> SL_LOG2))
+        fl_bitmap &= ~(1U << (index >> SL_LOG2));
 }
 
 /*
@@ -204,15 +587,34 @@ static void * extend_heap(size_t words){
     char *bp;
     size_t size;
     size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
-    if((long)(bp = mem_sbrk(size)) == (-1))
+    size = MIN(size, MAX_BLKSIZE);
+    if((long)(bp = mem_sbrk(MIN(size, SBRK_MAX))) == (-1))
         return NULL;
+    /* the rest of a large extension, the heap is contiguous */
+    for(size_t done = SBRK_MAX; done < size; done += SBRK_MAX){
+        if((long)mem_sbrk(MIN(size - done, SBRK_MAX)) == (-1)){
+            size = done;
+            break;
+        }
+    }
+    heap_hiwater = MAX(heap_hiwater, (char *)mem_heap_hi() + 1);
+    peak_bytes = MAX(peak_bytes, mem_heapsize() + mmap_bytes);
     /* allocate new block and set it unallocated */
     size_t alloc = GET_PREVALLOC(HDRP(bp));
     //size_t alloc = GET_ALLOC(HDRP(PREV_BLKP(bp)));
     PUT(HDRP(bp), PACK(size, alloc));
     PUT(FTRP(bp), PACK(size, alloc));
     PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));       /* Restore epilogue header */
-    return coalesce(bp);
+    n_extends++;
+    char * newbp = coalesce(bp);
+    /* the old footer and epilogue are inside a blank block now, keep it clean */
+    if(newbp != bp){
+        PUT(HDRP(bp), 0);
+        PUT(HDRP(bp) - WSIZE, 0);
+    }
+    else if(!alloc)     /* two blank blocks, too large to merge */
+        zero_lo = MAX(zero_lo, bp + DSIZE);
+    return newbp;
 }
 
 /*
@@ -226,27 +628,47 @@ static void * coalesce(void * bp){
     size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
     size_t size = GET_SIZE(HDRP(bp));
     //printf("%ld %ld\n",prev_alloc,temp);
+#ifdef MM_HARDEN
+    /* a blank neighbour overwritten, before merging garbage into the lists */
+    if(!next_alloc && GET(HDRP(NEXT_BLKP(bp))) != GET(FTRP(NEXT_BLKP(bp))))
+        harden_fail(NEXT_BLKP(bp), "blank block corrupted", __func__);
+    if(!prev_alloc && GET(HDRP(PREV_BLKP(bp))) != GET(FTRP(PREV_BLKP(bp))))
+        harden_fail(PREV_BLKP(bp), "blank block corrupted", __func__);
+#endif
+#ifdef MM_HEAP64
+    /* do not merge into a block larger than a header can hold,
+     *      treat such a neighbour as if it was allocated */
+    if(!next_alloc && size + GET_SIZE(HDRP(NEXT_BLKP(bp))) > MAX_BLKSIZE)
+        next_alloc = 0x4;
+    if(!prev_alloc && size + GET_SIZE(HDRP(PREV_BLKP(bp))) + 
+            (next_alloc ? 0 : GET_SIZE(HDRP(NEXT_BLKP(bp)))) > MAX_BLKSIZE)
+        prev_alloc = 0x4;
+#endif
     /* Case 1: has prev and next, then just insert it */
     if(prev_alloc && next_alloc){
-        PUT(HDRP(NEXT_BLKP(bp)), PACK(GET_SIZE(HDRP(NEXT_BLKP(bp))), 0x1));
-        //PUT(FTRP(NEXT_BLKP(bp)), PACK(GET_SIZE(HDRP(NEXT_BLKP(bp))), 0x1));  
+        PUT(HDRP(NEXT_BLKP(bp)), GET(HDRP(NEXT_BLKP(bp))) & ~0x2);
+        if(!GET_ALLOC(HDRP(NEXT_BLKP(bp))))     /* too large to merge */
+            PUT(FTRP(NEXT_BLKP(bp)), GET(HDRP(NEXT_BLKP(bp))));
         insert(bp);
         //printf("Case 1\n");
         return bp;
     }
     /* Case 2: only has prev, coalesce the next one */
     else if(prev_alloc && !next_alloc){
+        n_coalesces++;
         delete(NEXT_BLKP(bp));      
         size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-        PUT(HDRP(bp), PACK(size, prev_alloc));
-        PUT(FTRP(bp), PACK(size, prev_alloc));  
+        PUT(HDRP(bp), PACK(size, GET_PREVALLOC(HDRP(bp))));
+        PUT(FTRP(bp), PACK(size, GET_PREVALLOC(HDRP(bp))));  
         //printf("Case 2\n");
     }
     /* Case 3: only has next, coalesce the prev one */
     else if(!prev_alloc && next_alloc){
+        n_coalesces++;
         delete(PREV_BLKP(bp));
-        PUT(HDRP(NEXT_BLKP(bp)), PACK(GET_SIZE(HDRP(NEXT_BLKP(bp))), 0x1));
-        //PUT(FTRP(NEXT_BLKP(bp)), PACK(GET_SIZE(HDRP(NEXT_BLKP(bp))), 0x1)); 
+        PUT(HDRP(NEXT_BLKP(bp)), GET(HDRP(NEXT_BLKP(bp))) & ~0x2);
+        if(!GET_ALLOC(HDRP(NEXT_BLKP(bp))))     /* too large to merge */
+            PUT(FTRP(NEXT_BLKP(bp)), GET(HDRP(NEXT_BLKP(bp))));
         size += GET_SIZE(HDRP(PREV_BLKP(bp)));
         size_t alloc_ = GET_PREVALLOC(FTRP(PREV_BLKP(bp)));
         PUT(FTRP(bp), PACK(size, alloc_));
@@ -256,6 +678,7 @@ static void * coalesce(void * bp){
     }
     /* Case 4: coalesce the prev and the next */
     else{ 
+        n_coalesces += 2;
         delete(NEXT_BLKP(bp));
         delete(PREV_BLKP(bp));
         size += GET_SIZE(HDRP(PREV_BLKP(bp))) + 
@@ -274,7 +697,7 @@ static void * coalesce(void * bp){
 /*
  * malloc, same as the one from the textbook
  */
-void *malloc (size_t size) {
+static void * malloc_block(size_t size){
     //printf("malloc:%lu!\n",size);
     //mm_checkheap(__func__);
     size_t asize;
@@ -286,69 +709,124 @@ void *malloc (size_t size) {
     }
     if(size == 0)
         return NULL;
+    if(mmap_threshold && size >= mmap_threshold)
+        return mmap_alloc(size);
+    if(size > MAX_BLKSIZE - DSIZE - HARDEN_SIZE)
+        return NULL;
     /* Find the space for new block */
-    if(size <= DSIZE)
-        asize = 2 * DSIZE;
-    else
-        asize = DSIZE * ((size + (WSIZE) + (DSIZE - 1)) / DSIZE);
-    if((bp = find_fit(asize)) != NULL){
+    asize = adjust_size(size + HARDEN_SIZE);
+    req_avg = req_avg - req_avg / 8 + asize / 8;
+    /* a quick block of this size is ready to use as it is */
+    if(asize <= quick_max && GET_QHEAD(QUICK_INDEX(asize))){
+        bp = ADDR(GET_QHEAD(QUICK_INDEX(asize)));
+        SET_QHEAD(QUICK_INDEX(asize), GET(bp));
+        quick_count--;
+        quick_bytes -= asize;
+    }
+    else{
+        /* merge the quick blocks before giving up */
+        if((bp = find_fit(asize)) == NULL && quick_count){
+            consolidate();
+            bp = find_fit(asize);
+        }
+        /* Extend if dont have enough space */
+        if(bp == NULL){
+            extendsize = grow_size(asize);
+            if((bp = extend_heap(extendsize / WSIZE)) == NULL){
+#ifdef MM_HARDEN
+                /* out of memory, reuse the quarantined blocks now */
+                quarantine_release(0);
+                consolidate();
+                if((bp = find_fit(asize)) == NULL)
+#endif
+                return NULL;
+            }
+        }
         place(bp, asize);
-        return bp;
     }
-    /* Extend if dont have enough space */
-    extendsize = MAX(asize, CHUNKSIZE);
-    if((bp = extend_heap(extendsize / WSIZE)) == NULL)
-        return NULL;
-    place(bp, asize);
+    HARDEN_SEAL(bp, size);
+    n_mallocs++;
+    live_blocks++;
+    req_bytes += size;
+    granted_bytes += GET_SIZE(HDRP(bp)) - WSIZE;
 
     return bp;
 }
 
 /*
- * first_fit work better in this file in my machine
- * best_fit may use more time and a little bit higher utilization
+ * Map a block by itself, its header is marked with 0x4
  */
-static void * find_fit(size_t size){
-    // printf("find!\n");
-    //mm_checkheap(__func__);
-    return first_fit(size);
+static void * mmap_alloc(size_t size){
+    char * base;
+    size_t len;
+    if(size > ~(size_t)0 - 2 * (size_t)getpagesize())
+        return NULL;
+    len = (size_t)PAGE_UP(size + 2 * DSIZE);
+    base = mmap(NULL, len, PROT_READ | PROT_WRITE, 
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED)
+        return NULL;
+    *(size_t *)base = len;
+    PUT(base + 2 * DSIZE - WSIZE, PACK(0, 0x5));
+    n_mallocs++;
+    mmap_blocks++;
+    mmap_bytes += len;
+    peak_bytes = MAX(peak_bytes, mem_heapsize() + mmap_bytes);
+    return base + 2 * DSIZE;
 }
 
+/*
+ * Block size for a request of size bytes: header + payload, aligned
+ */
+static size_t adjust_size(size_t size){
+    if(size <= DSIZE)
+        return 2 * DSIZE;
+    return DSIZE * ((size + (WSIZE) + (DSIZE - 1)) / DSIZE);
+}
 
 /*
- * find the first fitted space for new block
+ * Only class_fit is left, first_fit and best_fit walked lists or the heap
  */
-static void * first_fit(size_t size){
-    //printf("first_fit\n");
-    //mm_checkheap(__func__);
-    int index = head_match(size);
-    char * bp;
-    while(index < CSIZE){
-        bp = heap_listp + GET_HEAD(index);
-        while(bp > heap_listp){            
-            if(GET_SIZE(HDRP(bp)) >= size){             
-                return (void *)bp;
-            }          
-            bp = heap_listp + GET_NEXTP(bp);            
-        }
-        index++;
-    }
-    return NULL;
+static void * find_fit(size_t size){
+    return class_fit(size);
 }
 
-static void * best_fit(size_t size){
-    void * tmp = NULL;
-    void * bp;
-    size_t min_size = 1 << 30;
-    for(bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)){
-        if((GET_SIZE(HDRP(bp)) >= size) && (!GET_ALLOC(HDRP(bp)))){
-            if(min_size > GET_SIZE(HDRP(bp))){
-                min_size = GET_SIZE(HDRP(bp));
-                tmp = bp;
-            }
+/*
+ * Good fit in O(1) for small blocks:
+ *      1. the head of its own list, which is usually large enough
+ *      2. the first non-empty larger list, any block there is large enough
+ *      3. walk its own list before giving up and extending the heap
+ * Best fit in O(log n) for large blocks, lists of them are treaps
+ */
+static void * class_fit(size_t size){
+    int index = head_match(size);
+    int next;
+    unsigned int t;
+    char * bp = ADDR(GET_HEAD(index));
+    if(index >= TREE_CLASS){
+        if((t = tree_fit(GET_HEAD(index), size)) != 0)
+            return (void *)ADDR(t);
+    }
+    else if(bp > heap_listp && GET_SIZE(HDRP(bp)) >= size)
+        return (void *)bp;
+    if(index + 1 < NCLASS && (next = find_class(index + 1)) >= 0){
+        /* the smallest one of a treap is its leftmost node */
+        if(next >= TREE_CLASS){
+            for(t = GET_HEAD(next); LEFT(t); t = LEFT(t))
+                ;
+            return (void *)ADDR(t);
         }
+        return (void *)ADDR(GET_HEAD(next));
+    }
+    if(index >= TREE_CLASS)
+        return NULL;
+    /* nothing larger, try the rest of its own list */
+    while(bp > heap_listp){
+        if(GET_SIZE(HDRP(bp)) >= size)
+            return (void *)bp;
+        bp = ADDR(GET_NEXTP(bp));
     }
-    return tmp;
+    return NULL;
 }
 
 /*
@@ -368,6 +846,7 @@ static void place(void * ptr, size_t size){
         PUT(HDRP(NEXT_BLKP(ptr)), PACK(blank_size - size, 0x2));
         PUT(FTRP(NEXT_BLKP(ptr)), PACK(blank_size - size, 0x2));
         insert(NEXT_BLKP(ptr));
+        n_splits++;
     }
     /* simply put it into the block */
     else{
@@ -378,19 +857,51 @@ static void place(void * ptr, size_t size){
         if(!alloc_)
             PUT(FTRP(NEXT_BLKP(ptr)), PACK(GET_SIZE(HDRP(NEXT_BLKP(ptr))), 0x2 | alloc_));
     }
+    /* pages given back are in use again */
+    trim_lo = MAX(trim_lo, NEXT_BLKP(ptr) + DSIZE);
+    zero_lo = MAX(zero_lo, NEXT_BLKP(ptr) + DSIZE);
 }
 
 /*
  * free, use after malloc
  */
-void free (void *bp) {
+static void free_block(void * bp){
     //printf("free:%p\n",bp);
     //mm_checkheap(__func__);
     if(bp == 0)
         return;
-    size_t size = GET_SIZE(HDRP(bp));
+    n_frees++;
+    if(GET_MMAPPED(HDRP(bp))){
+        mmap_blocks--;
+        mmap_bytes -= MMAP_LEN(bp);
+        munmap((char *)bp - 2 * DSIZE, MMAP_LEN(bp));
+        return;
+    }
+    live_blocks--;
     if(heap_listp == 0)
         mm_init();
+#ifdef MM_HARDEN
+    quarantine(bp);
+#else
+    release_block(bp);
+#endif
+}
+
+/*
+ * Put an allocated block back, free calls it or the quarantine
+ */
+static void release_block(char * bp){
+    size_t size = GET_SIZE(HDRP(bp));
+
+    /* a small block waits in its quick list, still marked allocated */
+    if(size <= quick_max){
+        PUT(bp, GET_QHEAD(QUICK_INDEX(size)));
+        SET_QHEAD(QUICK_INDEX(size), OFFSET(bp));
+        quick_bytes += size;
+        if(++quick_count >= QUICK_BATCH)
+            consolidate();
+        return;
+    }
             
     /* set it unallocated */
     size_t alloc = GET_PREVALLOC(HDRP(bp));
@@ -398,52 +909,311 @@ void free (void *bp) {
     //printf("%ld %ld\n",alloc,alloc2);
     PUT(HDRP(bp), PACK(size, alloc));
     PUT(FTRP(bp), PACK(size, alloc));
-    coalesce(bp);
+    trim(bp, size, coalesce(bp));
 }
 
+#ifdef MM_HARDEN
 /*
- * realloc
+ * Report the corrupted block and stop, nothing can be trusted any more
  */
-void *realloc(void *oldptr, size_t size) {
-    //printf("realloc!\n");
-    // mm_checkheap(__func__);
+static void harden_fail(void * bp, const char * what, const char * where){
+    fprintf(stderr, "mm: %s, block %p, found in %s\n", what, bp, where);
+    abort();
+}
+
+/*
+ * Check the header, trailer and canary of an allocated block,
+ *      or the poison of a freed one, return its requested size
+ */
+static size_t harden_check(char * bp, const char * where, int freed){
+    size_t size = GET_SIZE(HDRP(bp));
+    /* the header is read before the checksum, make sure it leads somewhere */
+    if(!GET_ALLOC(HDRP(bp)) || size < 2 * DSIZE || 
+            bp + size > (char *)mem_heap_hi() + 1)
+        harden_fail(bp, "header corrupted or not a block", where);
+    char * t = TRAILER(bp);
+    size_t slack = GET(t);
+    unsigned int sum = CHECKSUM(bp, slack);
+    if(GET(t + WSIZE) != (freed ? ~sum : sum))
+        harden_fail(bp, freed ? "quarantined block corrupted" : 
+            "double free, or header or trailer corrupted", where);
+    if(slack > (size_t)(t - bp))
+        harden_fail(bp, "trailer corrupted", where);
+    if(freed){
+        for(char * p = bp + WSIZE; p < MIN(bp + POISON_MAX, t); p++)
+            if(*(unsigned char *)p != POISON)
+                harden_fail(bp, "write after free", where);
+    }
+    else{
+        for(char * p = t - slack; p < MIN(t - slack + CANARY_MAX, t); p++)
+            if(*(unsigned char *)p != CANARY)
+                harden_fail(bp, "write past the end", where);
+    }
+    return (t - bp) - slack;
+}
+
+/*
+ * Write the canary and trailer of a block handed out with size bytes
+ */
+static void harden_seal(char * bp, size_t size){
+    if(GET_MMAPPED(HDRP(bp)))
+        return;
+    char * t = TRAILER(bp);
+    size_t slack = MIN((size_t)(t - bp) - size, 0xFFFFFFFFU);
+    memset(t - slack, CANARY, MIN(slack, CANARY_MAX));
+    PUT(t, slack);
+    PUT(t + WSIZE, CHECKSUM(bp, slack));
+}
+
+/*
+ * Free bp into the quarantine: check it, flip its checksum so that another
+ *      free is caught, poison it, and release the oldest blocks over budget
+ */
+static void quarantine(char * bp){
+    harden_check(bp, "free", 0);
+    char * t = TRAILER(bp);
+    PUT(t + WSIZE, ~GET(t + WSIZE));
+    memset(bp + WSIZE, POISON, MIN(bp + POISON_MAX, t) - (bp + WSIZE));
+    PUT(bp, 0);
+    if(q_tail)
+        PUT(q_tail, OFFSET(bp));
+    else
+        q_head = bp;
+    q_tail = bp;
+    q_bytes += GET_SIZE(HDRP(bp));
+    quarantine_release(quarantine_max);
+}
+
+/*
+ * Release the oldest quarantined blocks until at most keep bytes are left
+ */
+static void quarantine_release(size_t keep){
+    char * bp;
+    while(q_head && q_bytes > keep){
+        bp = q_head;
+        q_head = GET(bp) ? ADDR(GET(bp)) : 0;
+        if(!q_head)
+            q_tail = 0;
+        /* the link is not poisoned */
+        harden_check(bp, "quarantine", 1);
+        q_bytes -= GET_SIZE(HDRP(bp));
+        release_block(bp);
+    }
+}
+#endif
+
+/*
+ * How many bytes to extend the heap by for a block of asize
+ */
+static size_t grow_size(size_t asize){
+    size_t size = MAX(grow_next, req_avg * grow_reqs);
+    size = MAX(MIN(size, grow_max), asize);
+    grow_next = MIN(grow_next * 2, grow_max);
+    return size;
+}
+
+/*
+ * Merge every quick block into the free lists, like free used to
+ *      a quick neighbour looks allocated, it is merged when its turn comes
+ */
+static void consolidate(void){
+    char * bp;
+    size_t size, alloc;
+    for(int i = 0; i < NQUICK; i++){
+        while(GET_QHEAD(i)){
+            bp = ADDR(GET_QHEAD(i));
+            SET_QHEAD(i, GET(bp));
+            size = GET_SIZE(HDRP(bp));
+            alloc = GET_PREVALLOC(HDRP(bp));
+            PUT(HDRP(bp), PACK(size, alloc));
+            PUT(FTRP(bp), PACK(size, alloc));
+            coalesce(bp);
+        }
+    }
+    quick_count = 0;
+    quick_bytes = 0;
+}
+
+/*
+ * Give back pages of a large blank block bp, which has just been freed
+ *      1. the last block: every page not given back yet
+ *      2. others: only the pages of the freed part, so that freeing 
+ *          a small block next to a large blank one is still cheap
+ * Keep the links at the front and the footer at the end
+ */
+static void trim(char * freed, size_t size, char * bp){
+    char * lo;
+    char * hi;
+    int last = (GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0);
+    if(last && GET_SIZE(HDRP(bp)) >= trim_threshold){
+        lo = PAGE_UP(bp + DSIZE);
+        hi = PAGE_DOWN(MIN(FTRP(bp), trim_lo));
+    }
+    else if(size >= trim_threshold){
+        lo = PAGE_UP(freed + DSIZE);
+        hi = PAGE_DOWN(freed + size - DSIZE);
+    }
+    else
+        return;
+    if(hi <= lo || madvise(lo, hi - lo, MADV_DONTNEED) != 0)
+        return;
+    if(last){
+        trim_lo = MIN(trim_lo, lo);
+        grow_next = MAX(grow_next / 2, grow_min);   /* grew too much */
+    }
+    /* the pages read back as zero, up to where it was clean already */
+    if(last && hi >= zero_lo)
+        zero_lo = MIN(zero_lo, lo);
+}
+
+/*
+ * memcpy and memset, large ones with non-temporal stores:
+ *      a block that large is not read again soon, 
+ *      so it should not push everything else out of the cache
+ */
+static void copy_bytes(void * dst, const void * src, size_t n){
+#ifdef __SSE2__
+    if(n >= NT_THRESHOLD){
+        /* dst is aligned to 8, stream from the next 16 */
+        size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+        memcpy(dst, src, head);
+        char * d = (char *)dst + head;
+        const char * s = (const char *)src + head;
+        for(n -= head; n >= 64; n -= 64, d += 64, s += 64){
+            __m128i a = _mm_loadu_si128((const __m128i *)s);
+            __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+            __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+            __m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+            _mm_stream_si128((__m128i *)d, a);
+            _mm_stream_si128((__m128i *)(d + 16), b);
+            _mm_stream_si128((__m128i *)(d + 32), c);
+            _mm_stream_si128((__m128i *)(d + 48), e);
+        }
+        _mm_sfence();
+        memcpy(d, s, n);
+        return;
+    }
+#endif
+    memcpy(dst, src, n);
+}
+
+static void zero_bytes(void * dst, size_t n){
+#ifdef __SSE2__
+    if(n >= NT_THRESHOLD){
+        size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+        memset(dst, 0, head);
+        char * d = (char *)dst + head;
+        __m128i z = _mm_setzero_si128();
+        for(n -= head; n >= 64; n -= 64, d += 64){
+            _mm_stream_si128((__m128i *)d, z);
+            _mm_stream_si128((__m128i *)(d + 16), z);
+            _mm_stream_si128((__m128i *)(d + 32), z);
+            _mm_stream_si128((__m128i *)(d + 48), z);
+        }
+        _mm_sfence();
+        memset(d, 0, n);
+        return;
+    }
+#endif
+    memset(dst, 0, n);
+}
+
+/*
+ * realloc, grow in place whenever possible:
+ *      1. shrink, or the block is large enough already
+ *      2. absorb the next block if it is free
+ *      3. extend the heap if the block is the last one
+ *      4. malloc new spaces and use memcpy, with some more space
+ *          so that a buffer which keeps growing is not copied every time
+ */
+static void * realloc_block(void * oldptr, size_t size){
     void * newptr;
+    char * next;
+    size_t extendsize;
     if(size == 0){
-        free(oldptr);
+        free_block(oldptr);
         return 0;
     }
     if(oldptr == NULL)
-        return malloc(size);
+        return malloc_block(size);
+    /* too large for any block, adjust_size would wrap around */
+    if(size > MAX_BLKSIZE - DSIZE - HARDEN_SIZE)
+        return NULL;
+    /* a mapped block stays mapped with mremap, or moves into the heap */
+    if(GET_MMAPPED(HDRP(oldptr))){
+        size_t len = MMAP_LEN(oldptr);
+        char * base = (char *)oldptr - 2 * DSIZE;
+        if(size >= mmap_threshold / 2 && size <= ~(size_t)0 - 2 * (size_t)getpagesize()){
+            size_t newlen = (size_t)PAGE_UP(size + 2 * DSIZE);
+            if(newlen == len)
+                return oldptr;
+            if((base = mremap(base, len, newlen, MREMAP_MAYMOVE)) == MAP_FAILED)
+                return NULL;
+            *(size_t *)base = newlen;
+            mmap_bytes += newlen - len;
+            peak_bytes = MAX(peak_bytes, mem_heapsize() + mmap_bytes);
+            return base + 2 * DSIZE;
+        }
+        if((newptr = malloc_block(size)) == NULL)
+            return NULL;
+        copy_bytes(newptr, oldptr, MIN(size, len - 2 * DSIZE));
+        free_block(oldptr);     /* unmaps it, and counts it as freed */
+        return newptr;
+    }
     size_t oldsize = GET_SIZE(HDRP(oldptr));
-    size_t needsize = ALIGN(size) + DSIZE;
+    size_t copysize = oldsize - WSIZE;
+#ifdef MM_HARDEN
+    copysize = harden_check(oldptr, __func__, 0);
+#endif
+    size_t needsize = adjust_size(size + HARDEN_SIZE);
     size_t alloc = GET_PREVALLOC(HDRP(oldptr));
-    //size_t alloc = GET_ALLOC(HDRP(PREV_BLKP(oldptr)));
+    next = NEXT_BLKP(oldptr);
+    if(oldsize < needsize){
+        /* the last block, or the last but one before a blank block */
+        extendsize = needsize - oldsize;
+        if(!GET_ALLOC(HDRP(next)))
+            extendsize = (extendsize > GET_SIZE(HDRP(next))) ? 
+                extendsize - GET_SIZE(HDRP(next)) : 0;
+        if(extendsize && (GET_SIZE(HDRP(next)) == 0 || 
+                (!GET_ALLOC(HDRP(next)) && GET_SIZE(HDRP(NEXT_BLKP(next))) == 0))){
+            extendsize = grow_size(extendsize);
+            if(extend_heap(extendsize / WSIZE) == NULL)
+                return NULL;
+        }
+        /* absorb the next blank block */
+        if(!GET_ALLOC(HDRP(next)) && oldsize + GET_SIZE(HDRP(next)) >= needsize){
+            delete(next);
+            oldsize += GET_SIZE(HDRP(next));
+            PUT(HDRP(oldptr), PACK(oldsize, 1 | alloc));
+            next = NEXT_BLKP(oldptr);
+            PUT(HDRP(next), GET(HDRP(next)) | 0x2);
+            trim_lo = MAX(trim_lo, next + DSIZE);
+            zero_lo = MAX(zero_lo, next + DSIZE);
+        }
+    }
     /* if needsize is smaller, then split and create a new blank block */    
     if(oldsize >= needsize + (2 * DSIZE)){  /* may overflow if sub */
-        //mm_checkheap(__LINE__);
         PUT(HDRP(oldptr), PACK(needsize, 1 | alloc));
-        //PUT(FTRP(oldptr), PACK(needsize, 1 | alloc));
         PUT(HDRP(NEXT_BLKP(oldptr)), PACK(oldsize - needsize, 0x2));
         PUT(FTRP(NEXT_BLKP(oldptr)), PACK(oldsize - needsize, 0x2));    
         coalesce(NEXT_BLKP(oldptr));
+        n_splits++;
+        newptr = oldptr;
+    }
+    else if(oldsize >= needsize){
         newptr = oldptr;
     }
     /* malloc new spaces and use memcpy */
     else{
-        if((newptr = malloc(size)) == NULL)
+        /* a quarter more, unless that wraps around */
+        newptr = (size <= SIZE_MAX - (size >> 2)) ? 
+                malloc_block(size + (size >> 2)) : NULL;
+        if(newptr == NULL && (newptr = malloc_block(size)) == NULL)
             return NULL;
-        if(size < oldsize)
-            oldsize = size;
-        memcpy(newptr, oldptr, oldsize);        
-        free(oldptr);
+        copy_bytes(newptr, oldptr, copysize);
+        free_block(oldptr);
     }
-    /*mm_checkheap(__LINE__);
-    if((newptr = malloc(size)) == NULL)
-        return NULL;
-    if(size < oldsize)
-        oldsize = size;
-    memcpy(newptr, oldptr, oldsize);
-    free(oldptr);*/
+    HARDEN_SEAL(newptr, size);
     return newptr;
 }
 
@@ -452,17 +1222,118 @@ void *realloc(void *oldptr, size_t size) {
  * This function is not tested by mdriver, but it is
  * needed to run the traces.
  */
-void *calloc (size_t nmemb, size_t size) {
+static void * calloc_block(size_t nmemb, size_t size){
     // printf("calloc!\n");
+    char * newptr;
+    char * clean = zero_lo;     /* malloc_block moves it */
+    if(size && nmemb > SIZE_MAX / size)
+        return NULL;
     size_t bytes = nmemb * size;
-    void *newptr;
-    /* just malloc some spaces and set them to zero */
-    newptr = malloc(bytes);
-    memset(newptr, 0, bytes);
+    /* malloc some spaces, a mapped block is zero already */
+    if((newptr = malloc_block(bytes)) == NULL || GET_MMAPPED(HDRP(newptr)))
+        return newptr;
+    /* set the dirty part to zero, and the footer of the blank block */
+    clean = MIN(MAX(clean, newptr), newptr + bytes);
+    zero_bytes(newptr, clean - newptr);
+    char * ftr = FTRP(newptr);
+    if(ftr >= clean && ftr < newptr + bytes)
+        memset(ftr, 0, MIN(WSIZE, (size_t)(newptr + bytes - ftr)));
 
     return newptr;
 }
 
+/*
+ * The interface, every call is traced with -DMM_TRACE
+ */
+void *malloc (size_t size) {
+    void * bp = malloc_block(size);
+    TRACE(TRACE_MALLOC, NULL, size, bp);
+    return bp;
+}
+
+void free (void *bp) {
+    free_block(bp);
+    TRACE(TRACE_FREE, bp, 0, NULL);
+}
+
+void *realloc(void *oldptr, size_t size) {
+    void * newptr = realloc_block(oldptr, size);
+    TRACE(TRACE_REALLOC, oldptr, size, newptr);
+    return newptr;
+}
+
+void *calloc (size_t nmemb, size_t size) {
+    void * newptr = calloc_block(nmemb, size);
+    TRACE(TRACE_CALLOC, NULL, nmemb * size, newptr);
+    return newptr;
+}
+
+#ifdef MM_TRACE
+/*
+ * Record a call in the ring of this thread, write the ring out when full
+ *      seq keeps the order of calls from different threads
+ */
+static void trace(int op, void * ptr, size_t size, void * ret){
+    TRACE_REC * rec;
+    if(trace_fd < 0)
+        return;
+    if(trace_tid == 0){
+        trace_tid = __atomic_add_fetch(&trace_tids, 1, __ATOMIC_RELAXED);
+        /* any non-null value, so the destructor runs at thread exit */
+        pthread_setspecific(trace_key, &trace_tid);
+    }
+    rec = &trace_ring[trace_n];
+    rec->seq = __atomic_fetch_add(&trace_seq, 1, __ATOMIC_RELAXED);
+    rec->ptr = (uint64_t)(size_t)ptr;
+    rec->size = size;
+    rec->ret = (uint64_t)(size_t)ret;
+    rec->op = op;
+    rec->tid = trace_tid;
+    if(++trace_n == TRACE_RING)
+        mm_trace_flush();
+}
+
+void mm_trace_start(int fd){
+    if(trace_fd >= 0)
+        mm_trace_flush();
+    pthread_once(&trace_once, trace_setup);
+    trace_fd = fd;
+}
+
+static void trace_setup(void){
+    pthread_key_create(&trace_key, trace_exit);
+    atexit(trace_atexit);
+}
+
+static void trace_exit(void * arg){
+    mm_trace_flush();
+}
+
+/*
+ * Only the ring of the thread calling exit, threads still running 
+ *      at exit lose the records they have not flushed
+ */
+static void trace_atexit(void){
+    mm_trace_flush();
+}
+
+/*
+ * Every ring goes out in one write, records of a thread stay together
+ */
+void mm_trace_flush(void){
+    char * buf = (char *)trace_ring;
+    size_t left = trace_n * sizeof(TRACE_REC);
+    ssize_t n;
+    trace_n = 0;
+    while(trace_fd >= 0 && left > 0){
+        if((n = write(trace_fd, buf, left)) <= 0)
+            return;
+        buf += n;
+        left -= n;
+    }
+}
+#endif /* def MM_TRACE */
+
 
 /*
  * Return whether the pointer is in the heap.
@@ -480,36 +1351,170 @@ static int aligned(const void *p) {
     return (size_t)ALIGN(p) == (size_t)p;
 }
 
+/*
+ * Add up the blank blocks of a treap
+ */
+static void stats_tree(unsigned int t, MM_STATS * st, int fl){
+    if(!t)
+        return;
+    st->free_bytes[fl] += TSIZE(t);
+    st->free_blocks++;
+    st->largest_free = MAX(st->largest_free, TSIZE(t));
+    stats_tree(LEFT(t), st, fl);
+    stats_tree(RIGHT(t), st, fl);
+}
+
+/*
+ * mm_mallopt, like mallopt: set one of the tunables, 1 on success, 0 if
+ *      param is unknown or value out of range; settings survive mm_init
+ */
+int mm_mallopt(int param, int value){
+    size_t v = (size_t)value;
+    if(value < 0)
+        return 0;
+    switch(param){
+        case MM_QUICK_MAX:
+            if(v > QUICK_LIMIT)
+                return 0;
+            /* blocks waiting in lists that are turned off */
+            if(v < quick_max && heap_listp)
+                consolidate();
+            quick_max = v;
+            break;
+        case MM_MMAP_THRESHOLD:
+            mmap_threshold = v;
+            break;
+        case MM_TRIM_THRESHOLD:
+            trim_threshold = v;
+            break;
+        case MM_GROW_MIN:
+            grow_min = ALIGN(MAX(v, CHUNKSIZE));
+            grow_max = MAX(grow_max, grow_min);
+            grow_next = MAX(grow_next, grow_min);
+            break;
+        case MM_GROW_MAX:
+            grow_max = ALIGN(MAX(v, CHUNKSIZE));
+            grow_min = MIN(grow_min, grow_max);
+            grow_next = MIN(grow_next, grow_max);
+            break;
+        case MM_GROW_REQS:
+            grow_reqs = v;
+            break;
+#ifdef MM_HARDEN
+        case MM_QUARANTINE:
+            quarantine_max = v;
+            if(heap_listp)
+                quarantine_release(v);
+            break;
+#endif
+        default:
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * mm_stats, in O(number of blank blocks)
+ *      the allocated bytes are what is left of the heap
+ */
+void mm_stats(MM_STATS * st){
+    char * bp;
+    memset(st, 0, sizeof(MM_STATS));
+    if(heap_listp == 0)
+        return;
+    for(int i = 0; i < NCLASS; i++){
+        if(i >= TREE_CLASS){
+            stats_tree(GET_HEAD(i), st, i >> SL_LOG2);
+            continue;
+        }
+        for(bp = ADDR(GET_HEAD(i)); bp > heap_listp; bp = ADDR(GET_NEXTP(bp))){
+            st->free_bytes[i >> SL_LOG2] += GET_SIZE(HDRP(bp));
+            st->free_blocks++;
+            st->largest_free = MAX(st->largest_free, GET_SIZE(HDRP(bp)));
+        }
+    }
+    for(int i = 0; i < CSIZE; i++)
+        st->free_total += st->free_bytes[i];
+    st->ext_frag = st->free_total ? 
+        1.0 - (double)st->largest_free / st->free_total : 0.0;
+    st->heap_bytes = mem_heapsize();
+    /* heads, padding, prologue and epilogue are not blocks */
+    st->live_bytes = st->heap_bytes - (4 + NHEAD) * WSIZE - 
+        st->free_total - quick_bytes;
+    st->quick_blocks = quick_count;
+    st->quick_bytes = quick_bytes;
+#ifdef MM_HARDEN
+    st->live_bytes -= q_bytes;
+    st->quarantine_bytes = q_bytes;
+#else
+    st->quarantine_bytes = 0;
+#endif
+    st->live_blocks = live_blocks;
+    st->hdr_bytes = live_blocks * WSIZE;
+    st->pad_ratio = granted_bytes ? 
+        1.0 - (double)req_bytes / granted_bytes : 0.0;
+    st->mmap_blocks = mmap_blocks;
+    st->mmap_bytes = mmap_bytes;
+    st->peak_bytes = peak_bytes;
+    st->mallocs = n_mallocs;
+    st->frees = n_frees;
+    st->coalesces = n_coalesces;
+    st->splits = n_splits;
+    st->extends = n_extends;
+}
+
 /*
  * mm_checkheap
  */
 
 void print_block();
 
+/*
+ * Return 1 if the treap is broken: order, priority, or an allocated node
+ */
+static int check_tree(unsigned int t){
+    if(!t)
+        return 0;
+    if(GET_ALLOC(HDRP(ADDR(t))))
+        return 1;
+    if(LEFT(t) && (!tree_less(LEFT(t), t) || tree_prio(LEFT(t)) > tree_prio(t)))
+        return 1;
+    if(RIGHT(t) && (tree_less(RIGHT(t), t) || tree_prio(RIGHT(t)) > tree_prio(t)))
+        return 1;
+    return check_tree(LEFT(t)) || check_tree(RIGHT(t));
+}
+
 void mm_checkheap(int lineno){
     int flag = 0;
     char *bp, *ptr;
 
-    if ((GET_SIZE(HDRP(heap_listp)) != DSIZE) || !GET_ALLOC(HDRP(heap_listp)))
+    bp = heap_listp + ((2 + NHEAD) * WSIZE);
+    if ((GET_SIZE(HDRP(bp)) != DSIZE) || !GET_ALLOC(HDRP(bp)))
         flag = 1;
 
-    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-        if(GET(HDRP(bp)) != GET(FTRP(bp)))
+    /* only blank blocks have footers */
+    for (bp = NEXT_BLKP(bp); GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+        if(!GET_ALLOC(HDRP(bp)) && GET(HDRP(bp)) != GET(FTRP(bp)))
             flag = 1;
     }
 
     if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))))
         flag = 1;
     
-    for(int i = 0; i < CSIZE; i++){
+    for(int i = TREE_CLASS; i < NCLASS; i++){
+        if(check_tree(GET_HEAD(i)))
+            flag = 1;
+    }
+
+    for(int i = 0; i < TREE_CLASS; i++){
         if(GET_HEAD(i)){
-            ptr = heap_listp + GET_HEAD(i);
+            ptr = ADDR(GET_HEAD(i));
             while(ptr > heap_listp){            
-                if(ptr != heap_listp + (unsigned long)(heap_listp + GET_PREVP(ptr))){
+                if(GET_NEXTP(ptr) && GET_PREVP(ADDR(GET_NEXTP(ptr))) != OFFSET(ptr)){
                     flag = 1;   
                     break;
                 }                    
-                ptr = heap_listp + GET_NEXTP(ptr);            
+                ptr = ADDR(GET_NEXTP(ptr));            
             }
         }
     }
@@ -518,6 +1523,20 @@ void mm_checkheap(int lineno){
         print_block();
 }
 
+/*
+ * Print a treap in order
+ */
+static void print_tree(unsigned int t){
+    if(!t)
+        return;
+    print_tree(LEFT(t));
+    printf("address = %p\n", ADDR(t));
+    printf("size = %d; priority = %u\n", TSIZE(t), tree_prio(t));
+    printf("left address = %p\n", ADDR(LEFT(t)));
+    printf("right address = %p\n", ADDR(RIGHT(t)));
+    print_tree(RIGHT(t));
+}
+
 void print_block() {
     printf("\n==============DEBUG==============\n");
     
@@ -525,12 +1544,12 @@ void print_block() {
     
     printf("======block======\n");
 
-    char* ptr = heap_listp + ((1 + CSIZE) * WSIZE);
+    char* ptr = heap_listp + ((1 + NHEAD) * WSIZE);
     printf("Prologue address = %p\n",ptr);
     printf("Prologue size = %d\n",GET_SIZE(HDRP(ptr)));
     printf("Prologue alloc = %d\n",GET_ALLOC(HDRP(ptr)));
 
-    for(ptr = heap_listp + ((2 + CSIZE) * WSIZE); 
+    for(ptr = heap_listp + ((2 + NHEAD) * WSIZE); 
         GET_SIZE(HDRP(ptr)) > 0; ptr = NEXT_BLKP(ptr)){
         printf("address = %p\n",ptr);
         printf("header size = %d; footer size = %d\n", 
@@ -547,19 +1566,22 @@ void print_block() {
     printf("======block======\n\n");
     
     printf("======free lists======\n");
-    for(int i = 0; i < CSIZE; i++){
-        printf("class[%d] from %d to %d:\n", i, (1<<(i+4)), (1<<(i+5)));
-        if(GET_HEAD(i)){
-            ptr = heap_listp + GET_HEAD(i);
+    for(int i = 0; i < NCLASS; i++){
+        printf("class[%d][%d]:\n", i / SL_NUM, i % SL_NUM);
+        if(i >= TREE_CLASS && GET_HEAD(i)){
+            print_tree(GET_HEAD(i));
+        }
+        else if(GET_HEAD(i)){
+            ptr = ADDR(GET_HEAD(i));
             while(ptr > heap_listp){            
                 printf("address = %p\n",ptr);
                 printf("header size = %d; footer size = %d\n", 
                     GET_SIZE(HDRP(ptr)), GET_SIZE(FTRP(ptr)));
                 printf("header alloc = %d; footer alloc = %d\n", 
                     GET_ALLOC(HDRP(ptr)), GET_ALLOC(FTRP(ptr)));
-                printf("previous address = %p\n", heap_listp + GET_PREVP(ptr));     
-                printf("next address = %p\n", heap_listp + GET_NEXTP(ptr));    
-                ptr = heap_listp + GET_NEXTP(ptr);            
+                printf("previous address = %p\n", ADDR(GET_PREVP(ptr)));     
+                printf("next address = %p\n", ADDR(GET_NEXTP(ptr)));    
+                ptr = ADDR(GET_NEXTP(ptr));            
             }
         }
         else{
@@ -567,7 +1589,19 @@ void print_block() {
         }
         printf("\n");
     }
-    printf("======free lists======\n");
+    printf("======free lists======\n\n");
+
+    printf("======quick lists======\n");
+    for(int i = 0; i < NQUICK; i++){
+        printf("quick[%d] size %d:\n", i, (i + 2) * DSIZE);
+        for(ptr = ADDR(GET_QHEAD(i)); ptr > heap_listp; ptr = ADDR(GET(ptr))){
+            printf("address = %p\n", ptr);
+            printf("header size = %d; header alloc = %d\n", 
+                GET_SIZE(HDRP(ptr)), GET_ALLOC(HDRP(ptr)));
+        }
+        printf("\n");
+    }
+    printf("======quick lists======\n");
 
     printf("\n==============DEBUG==============\n");
 }
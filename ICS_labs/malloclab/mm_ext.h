@@ -0,0 +1,81 @@
+/*
+ * Extensions of the mm.h interface, not used by mdriver
+ *      allocation tracing, compile mm.c with -DMM_TRACE
+ *      heap statistics
+ *      tunables, like mallopt
+ */
+#ifndef __MM_EXT_H__
+#define __MM_EXT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Traced calls */
+#define TRACE_MALLOC 0
+#define TRACE_FREE 1
+#define TRACE_REALLOC 2
+#define TRACE_CALLOC 3
+
+/* 
+ * One traced call, as written to the trace file
+ *      ptr and ret are addresses in the traced process
+ */
+typedef struct{
+    uint64_t seq;   /* order of the call among all threads */
+    uint64_t ptr;   /* block passed to free and realloc */
+    uint64_t size;  /* size, nmemb * size for calloc */
+    uint64_t ret;   /* block returned */
+    uint32_t op;    /* TRACE_MALLOC ... */
+    uint32_t tid;   /* which thread, numbered from 1 */
+}TRACE_REC;
+
+/* Write the records of every thread to fd, -1 to stop */
+void mm_trace_start(int fd);
+/* Write the records of this thread now, they are buffered in a ring */
+void mm_trace_flush(void);
+
+#define MM_STATS_CLASSES 16     /* CSIZE in mm.c */
+
+/*
+ * Shape of the heap, mm_stats only walks the free lists
+ *      counters start from 0 at mm_init
+ */
+typedef struct{
+    size_t heap_bytes;      /* mem_heapsize() */
+    size_t free_bytes[MM_STATS_CLASSES];    /* blank bytes of each class */
+    size_t free_blocks;
+    size_t free_total;      /* blank bytes of all classes */
+    size_t largest_free;
+    double ext_frag;        /* 1 - largest_free / free_total */
+    size_t live_blocks;     /* allocated blocks in the heap */
+    size_t live_bytes;      /* and their sizes, headers included */
+    size_t quick_blocks;    /* freed blocks waiting in quick lists */
+    size_t quick_bytes;
+    size_t quarantine_bytes;    /* freed blocks held back, -DMM_HARDEN */
+    size_t hdr_bytes;       /* headers of the allocated blocks */
+    double pad_ratio;       /* alignment and unsplit bytes / payload bytes,
+                                of every malloc in the heap since mm_init */
+    size_t mmap_blocks;     /* blocks mapped by themselves */
+    size_t mmap_bytes;
+    size_t peak_bytes;      /* largest heap_bytes + mmap_bytes since mm_init */
+    unsigned long mallocs;
+    unsigned long frees;
+    unsigned long coalesces;    /* blank blocks merged with a neighbour */
+    unsigned long splits;       /* blocks split when placed or shrunk */
+    unsigned long extends;      /* calls to extend_heap */
+}MM_STATS;
+
+void mm_stats(MM_STATS *st);
+
+/* Parameters of mm_mallopt, sizes in bytes */
+#define MM_QUICK_MAX 1          /* largest block kept in quick lists, 0 off */
+#define MM_MMAP_THRESHOLD 2     /* map requests this large by themselves, 0 off */
+#define MM_TRIM_THRESHOLD 3     /* give back pages of blank blocks this large */
+#define MM_GROW_MIN 4           /* first extension of the heap */
+#define MM_GROW_MAX 5           /* largest extension, they double up to it */
+#define MM_GROW_REQS 6          /* extend by at least this many average requests */
+#define MM_QUARANTINE 7         /* bytes of freed blocks held back, -DMM_HARDEN */
+
+int mm_mallopt(int param, int value);
+
+#endif /* __MM_EXT_H__ */
@@ -0,0 +1,207 @@
+/*
+ * mm_replay - replay a trace written by mm.c built with -DMM_TRACE
+ *
+ * Build it like mdriver, with the settings of the traced allocator:
+ *      gcc -Wall -O2 -DDRIVER -DMM_DEFAULTS -o mm_replay mm_replay.c mm.c memlib.c
+ * Capture a trace from a process that uses mm.c built with -DMM_TRACE:
+ *      MM_TRACE_FILE=app.trace ./app
+ * Then:
+ *      ./mm_replay [-n rounds] app.trace
+ *
+ * Reports ops/sec, the peak footprint (heap and mapped blocks) and the 
+ *      utilization, which is the peak of live payload over the peak footprint.
+ * Blocks freed in the trace but allocated before tracing started are ignored.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "mm_ext.h"
+
+/* mm.c renames its functions to these with -DDRIVER */
+extern void *mm_malloc(size_t size);
+extern void mm_free(void *ptr);
+extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+
+/* One call of the trace, with blocks numbered instead of addresses */
+typedef struct{
+    int op;
+    long in;    /* block passed to free/realloc, -1 if none */
+    long out;   /* block returned, -1 if none */
+    size_t size;
+}OP;
+
+/* Address -> block number, open addressing */
+typedef struct{
+    uint64_t addr;
+    long id;
+}SLOT;
+
+static SLOT *table;
+static size_t table_mask;
+
+static int cmp_seq(const void *a, const void *b){
+    const TRACE_REC *x = a, *y = b;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static SLOT *lookup(uint64_t addr){
+    size_t i = (size_t)((addr >> 3) * 0x9e3779b97f4a7c15ULL) & table_mask;
+    while(table[i].addr && table[i].addr != addr)
+        i = (i + 1) & table_mask;
+    return &table[i];
+}
+
+/* The block at addr now, -1 if it was allocated before tracing */
+static long find_id(uint64_t addr){
+    SLOT *s = lookup(addr);
+    return s->addr ? s->id : -1;
+}
+
+static void set_id(uint64_t addr, long id){
+    SLOT *s = lookup(addr);
+    s->addr = addr;
+    s->id = id;
+}
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Read the trace and number the blocks, so that replaying it
+ *      only indexes an array
+ */
+static OP *load(char *path, long *nops, long *nblocks){
+    FILE *fp;
+    TRACE_REC *recs;
+    OP *ops;
+    long n, cap = 1 << 16, id = 0;
+
+    if((fp = fopen(path, "rb")) == NULL){
+        perror(path);
+        exit(1);
+    }
+    recs = malloc(cap * sizeof(TRACE_REC));
+    for(n = 0; recs && fread(&recs[n], sizeof(TRACE_REC), 1, fp) == 1; ){
+        if(++n == cap)
+            recs = realloc(recs, (cap *= 2) * sizeof(TRACE_REC));
+    }
+    fclose(fp);
+    if(recs == NULL){
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    /* rings of different threads are written out of order */
+    qsort(recs, n, sizeof(TRACE_REC), cmp_seq);
+
+    for(table_mask = 1; table_mask < 2 * (size_t)n; table_mask <<= 1)
+        ;
+    table = calloc(table_mask, sizeof(SLOT));
+    table_mask--;
+    ops = malloc((n + 1) * sizeof(OP));
+    for(long i = 0; i < n; i++){
+        ops[i].op = recs[i].op;
+        ops[i].size = recs[i].size;
+        ops[i].in = -1;
+        ops[i].out = -1;
+        if((recs[i].op == TRACE_FREE || recs[i].op == TRACE_REALLOC) && recs[i].ptr)
+            ops[i].in = find_id(recs[i].ptr);
+        if(recs[i].ret){
+            ops[i].out = id++;
+            set_id(recs[i].ret, ops[i].out);
+        }
+    }
+    free(recs);
+    free(table);
+    *nops = n;
+    *nblocks = id;
+    return ops;
+}
+
+int main(int argc, char **argv){
+    int opt, rounds = 1;
+    long nops, nblocks;
+    OP *ops;
+    void **blk;
+    size_t *sz;
+    MM_STATS st;
+
+    while((opt = getopt(argc, argv, "n:")) != -1){
+        switch(opt){
+            case 'n': rounds = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n rounds] <trace>\n", argv[0]);
+                exit(1);
+        }
+    }
+    if(optind != argc - 1){
+        fprintf(stderr, "usage: %s [-n rounds] <trace>\n", argv[0]);
+        exit(1);
+    }
+    ops = load(argv[optind], &nops, &nblocks);
+    blk = calloc(nblocks + 1, sizeof(void *));
+    sz = calloc(nblocks + 1, sizeof(size_t));
+
+    mem_init();
+    for(int r = 0; r < rounds; r++){
+        size_t live = 0, peak = 0;
+        double start, secs;
+        long skipped = 0;
+
+        mem_reset_brk();
+        if(mm_init() < 0){
+            fprintf(stderr, "mm_init failed\n");
+            exit(1);
+        }
+        memset(blk, 0, (nblocks + 1) * sizeof(void *));
+        start = now();
+        for(long i = 0; i < nops; i++){
+            OP *o = &ops[i];
+            void *in = (o->in >= 0) ? blk[o->in] : NULL;
+            void *out = NULL;
+            /* freeing a block allocated before tracing started */
+            if(o->op == TRACE_FREE && o->in < 0){
+                skipped++;
+                continue;
+            }
+            switch(o->op){
+                case TRACE_MALLOC: out = mm_malloc(o->size); break;
+                case TRACE_CALLOC: out = mm_calloc(1, o->size); break;
+                case TRACE_REALLOC: out = mm_realloc(in, o->size); break;
+                case TRACE_FREE: mm_free(in); break;
+            }
+            if(o->in >= 0){
+                live -= sz[o->in];
+                blk[o->in] = NULL;
+            }
+            if(o->out >= 0){
+                blk[o->out] = out;
+                sz[o->out] = o->size;
+                live += o->size;
+                if(live > peak)
+                    peak = live;
+            }
+        }
+        secs = now() - start;
+        mm_stats(&st);
+        printf("round %d: %ld ops in %.3f s, %.0f ops/sec\n",
+            r, nops - skipped, secs, (nops - skipped) / secs);
+        printf("    peak footprint %zu bytes, peak payload %zu bytes, utilization %.1f%%\n",
+            st.peak_bytes, peak, 100.0 * peak / st.peak_bytes);
+        /* give everything back for the next round */
+        for(long b = 0; b < nblocks; b++){
+            if(blk[b] != NULL)
+                mm_free(blk[b]);
+        }
+    }
+    return 0;
+}
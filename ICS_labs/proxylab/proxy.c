@@ -1,323 +1,3325 @@
+#define _GNU_SOURCE     /* for splice and tee */
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <netinet/tcp.h>
+#include <stdarg.h>
+#include <time.h>
+/* glibc declares a gai_error of its own with _GNU_SOURCE, csapp.h has one */
+#define gai_error glibc_gai_error
+#include <netdb.h>
+#undef gai_error
 #include "csapp.h"
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
-#define MAX_CACHE_NUM 10
+#define NSHARD 8    /* a line of max_object must fit in shard_size */
+#define SHARD_SIZE (MAX_CACHE_SIZE / NSHARD)
+#define NBUCKET 64  /* hash buckets in each shard */
+#define CHUNK_SIZE 16384    /* bytes of obj in a chunk from the pool */
+#define POOL_CHUNKS 256     /* free chunks kept in the pool */
+#define CHUNK_IOV 64    /* chunks sent by one writev */
+#define SKETCH_DEPTH 4  /* rows of the count-min sketch */
+#define SKETCH_BITS 13  /* 1 << SKETCH_BITS counters in a row */
+#define SKETCH_MAX 15   /* counters stop here, 4 bits as in TinyLFU */
+#define SKETCH_SAMPLE (10 << SKETCH_BITS)   /* accesses between two agings */
+#define METRICS_PATH "/metrics"     /* asked of the proxy itself, not a server */
+#define HIST_SUB_BITS 4     /* 16 buckets between two powers of 2 */
+#define HIST_MAX_BITS 40    /* microseconds below 2^40, about 12 days */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+#define LOG_RING (1 << 16)  /* bytes of log lines waiting for the logger */
+
+#define PIPE_SIZE 65536 /* default capacity of a pipe, bytes moved by one splice */
+#define MAX_EVENTS 64   /* events taken by one epoll_wait */
+#define NTHREADS 16     /* worker threads, -n */
+#define SBUFSIZE 64     /* accepted connections waiting for a worker, -q */
+#define NORIGIN 64      /* hash buckets of origins */
+#define POOL_SIZE 8     /* idle connections kept for one origin */
+#define DNS_TTL 60      /* seconds a resolved address is used */
+#define KEEPALIVE_TIMEOUT 5     /* seconds a client may idle between requests */
+#define DISK_SIZE (64 << 20)    /* bytes of the log on disk that start compaction, -D */
+#define NDBUCKET 1024   /* hash buckets of the disk index */
+#define DISK_MAGIC 0x70726f78   /* "prox", a record of the log starts here */
+#define DISK_QUEUE 64   /* jobs waiting for the disk thread, more are dropped */
+#define MAX_HDRS 64     /* header lines passed on from a request */
+#define MAX_IOV (MAX_HDRS + 10)     /* pieces of a request to the server */
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *Con_hdr = "Connection: close\r\n";
 static const char *P_Con_hdr = "Proxy-Connection: close\r\n";
+static const char *Keep_hdr = "Connection: keep-alive\r\n";
+
+/* Part of a request, by its offset in the buffer and its length */
+typedef struct{
+    size_t off;
+    size_t len;
+}SLICE;
+
+/* States of the request parser */
+#define RQ_LINE 0   /* the request line is next */
+#define RQ_HDRS 1   /* a header line, or the blank line after them */
+#define RQ_DONE 2   /* the blank line is in, pos is past it */
+
+/*
+ * A request from a client, parsed where it was read:
+ *      nothing is copied, the parts are slices of buf.
+ *      Method, uri and version are ended with '\0' in place.
+ */
+typedef struct{
+    char buf[MAXLINE];
+    size_t len;     /* bytes read into buf */
+    size_t pos;     /* bytes parsed, the start of the next line */
+    int state;      /* RQ_* */
+    SLICE method, uri, version;
+    SLICE host;     /* the Host line, len 0 if there is none */
+    SLICE hdr[MAX_HDRS];    /* the other lines passed on, with their CRLF */
+    int nhdr;
+    int keep;       /* the client stays after the response */
+    int http11;     /* an HTTP/1.1 client, the others take no chunked body */
+}REQUEST;
 
 /* http://+host+(:port)+path */
 typedef struct{
     char host[MAXLINE];  /* www.cmu.edu */
-    char port[MAXLINE];  /* NULL or specific number */
-    char path[MAXLINE]; /* /hub/index.html */
+    char port[MAXLINE];  /* 80 or specific number */
+    SLICE name;     /* host(:port) as in the uri, for a Host header */
+    SLICE path;     /* /hub/index.html, in the uri */
 }Request_Line;
 
+/*
+ * A piece of an object, CHUNK_SIZE bytes from the pool, 
+ *      only the last one of a sealed line may be smaller
+ */
+typedef struct CHUNK{
+    struct CHUNK *next;
+    size_t cap;     /* bytes of data */
+    char data[];
+}CHUNK;
+
+/* 
+ * A line holds its object in a list of chunks, filled while the object
+ *      is relayed. Chunks never move, so the part of a line filled so far
+ *      can be sent while more is added after it.
+ */
+typedef struct CACHE{
+    int ref;    /* CLOCK reference bit, set by hits without any lock */
+    int refcnt; /* the cache and every thread sending it, freed at 0 */
+    unsigned int hash;
+    int keep;   /* the response has its own length, the client may stay */
+    size_t size;    /* bytes of obj */
+    size_t bytes;   /* memory of the line, which counts against shard_size */
+    char *uri;
+    CHUNK *head, *tail;     /* obj */
+    size_t nchunk;
+    struct CACHE *next;     /* next line in the same bucket */
+    struct CACHE *clock_prev, *clock_next;  /* ring of the shard */
+    struct CACHE *gone;     /* next in the victims of a writer, or retired */
+    unsigned long epoch;    /* epoch_now when it was retired */
+}CACHE;
+
+/* 
+ * The cache is split into shards by the hash of uri, each with its own lock
+ *      for writers. Readers take no lock at all: the buckets are published
+ *      with release stores, and an evicted line is only put once every
+ *      lookup that might still see it is over (see cache_get)
+ */
+typedef struct{
+    CACHE *bucket[NBUCKET];
+    size_t bytes;   /* bytes of the lines in this shard */
+    CACHE *hand;    /* CLOCK hand, the next line to look at for eviction */
+    sem_t w;    /* lock for writer */
+    struct FLIGHT *flights; /* misses being fetched from the servers */
+    sem_t fmutex;   /* lock for flights */
+}SHARD;
+
+/*
+ * TinyLFU: how often each uri was asked for lately, in a count-min sketch.
+ *      a uri counts in one counter of each row, and its frequency is the 
+ *      smallest of them. Every SKETCH_SAMPLE accesses all counters are 
+ *      halved, so old popularity fades. Counters are updated with atomics 
+ *      and no lock, a lost update only makes a count a little low
+ */
+typedef struct{
+    unsigned char count[SKETCH_DEPTH][1 << SKETCH_BITS];
+    int adds;   /* accesses since the last aging */
+}SKETCH;
+
+/*
+ * Latencies in microseconds, HdrHistogram style: exact below 16, 
+ *      then 16 buckets between two powers of 2, so a value is known
+ *      within 1/16 of it, in a few KB for any range
+ */
+typedef struct{
+    unsigned long count[HIST_BUCKETS];
+    unsigned long n, sum, max;
+}HIST;
+
+/* How a request was answered */
+#define M_HIT 0     /* from the cache in memory */
+#define M_DISK 1    /* from the disk tier */
+#define M_WAIT 2    /* from the miss of another client, coalesced */
+#define M_MISS 3    /* fetched from the server */
+#define M_FAIL 4    /* bad uri, or the server could not be reached */
+#define NKIND 5
+
+/*
+ * The epoch a thread's lookup started in, 0 while it is not looking up.
+ *      Only that thread writes it; writers read every thread's
+ */
+typedef struct EPOCH{
+    unsigned long epoch;
+    struct EPOCH *next;     /* every thread's, in epoch_list */
+    char pad[48];   /* a line of its own, the store of a hit hits no other */
+}EPOCH;
+
+/*
+ * Counters of one thread. Only that thread writes them, with plain 
+ *      atomic stores and no lock; the metrics page adds up every thread's
+ */
+typedef struct STATS{
+    unsigned long requests[NKIND];
+    unsigned long bytes[NKIND];     /* of responses */
+    HIST ttfb;      /* request in to the first byte out */
+    HIST total;     /* request in to the last byte out */
+    HIST connect;   /* new connections to servers */
+    struct STATS *next;     /* every thread's, in stats_list */
+}STATS;
+
+/* One request being timed */
+typedef struct{
+    unsigned long start, first;     /* microseconds, first is 0 until sent */
+    size_t bytes;
+    int kind;   /* M_* */
+}METER;
+
+/*
+ * Log lines wait here for the logger thread, so no request waits for
+ *      stdout. Lines that do not fit are dropped and counted
+ */
 typedef struct{
-    int LRU;    /* line with the greatest LRU will be evicted */
+    char buf[LOG_RING];
+    unsigned long head, tail;   /* bytes ever added and written */
+    unsigned long dropped;
+    sem_t mutex;    /* lock for everything above */
+    sem_t lines;    /* lines added, the logger waits for them */
+}LOGRING;
+
+/* A thread sent the response of a flight, and how far it is */
+typedef struct FOLLOWER{
+    size_t off;     /* bytes sent, the chunks before it are not needed */
+    struct FOLLOWER *next;
+}FOLLOWER;
+
+/*
+ * A miss in flight: the first thread to miss a uri fetches it,
+ *      later misses of the same uri wait here and are sent the response 
+ *      from the line as it grows, the line is put into the cache at the end.
+ *      Past max_object only a window of the line is kept for them:
+ *      the chunks every follower sent are freed from the head
+ */
+typedef struct FLIGHT{
     char uri[MAXLINE];
-    char obj[MAX_OBJECT_SIZE];
-    sem_t mutex;    /* lock for reader */
+    CACHE *line;    /* line->size bytes are in, NULL once no one needs them */
+    size_t base;    /* bytes freed from the head of line */
+    int done;       /* 1 complete, -1 failed */
+    int keep;       /* the response has its own length, set before done */
+    int users;      /* the fetching thread and the waiting ones, freed at 0 */
+    int open;       /* still in flights of its shard, so misses join it */
+    FOLLOWER *followers;    /* the waiting ones, once they started */
+    pthread_mutex_t lock;   /* lock for everything above */
+    pthread_cond_t more;    /* line has grown, or it is done */
+    pthread_cond_t sent;    /* a follower sent more, or left */
+    struct FLIGHT *next;
+}FLIGHT;
+
+/* 
+ * Bounded buffer of accepted fds, from textbook p707 picture 12-24
+ *      main blocks on slots when it is full, and stops accepting
+ */
+typedef struct{
+    int *buf;   /* Buffer array */
+    int n;      /* Maximum number of slots */
+    int front;  /* buf[(front+1)%n] is first item */
+    int rear;   /* buf[rear%n] is last item */
+    sem_t mutex;    /* Protects accesses to buf */
+    sem_t slots;    /* Counts available slots */
+    sem_t items;    /* Counts available items */
+}sbuf_t;
+
+/*
+ * A keep-alive client between two requests, waiting in the poller
+ *      instead of in a worker; oldest first, as they expire
+ */
+typedef struct IDLE{
+    int fd;
+    time_t since;
+    struct IDLE *prev, *next;
+}IDLE;
+
+/*
+ * A server by host and port: the address it was resolved to,
+ *      and the connections to it that are idle, kept alive with HTTP/1.1
+ */
+typedef struct ORIGIN{
+    char host[MAXLINE];
+    char port[MAXLINE];
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int family, socktype, protocol;
+    time_t resolved;    /* when addr was found, 0 if never */
+    int idle[POOL_SIZE];
+    int nidle;
+    struct ORIGIN *next;
+}ORIGIN;
+
+/*
+ * The second tier of the cache: lines evicted from memory are appended
+ *      to a log on disk, -d dir, as a record each: DISK_REC, uri, obj.
+ *      The log is all there is on disk, the index is built from it at start.
+ */
+typedef struct{
+    unsigned int magic;     /* DISK_MAGIC */
+    unsigned int hash;
+    unsigned int uri_len;   /* bytes of uri, without '\0' */
+    int keep;
+    unsigned long size;     /* bytes of obj */
+}DISK_REC;
+
+/* Bytes of a record in the log */
+#define DISK_BYTES(size, uri_len)   (sizeof(DISK_REC) + (uri_len) + (size))
+
+/* Where the obj of a uri is in the log */
+typedef struct DISK_ENT{
+    unsigned int hash;
+    int ref;    /* hit since the last compaction, set without any lock */
+    int keep;
+    off_t off;
+    size_t size;
+    struct DISK_ENT *next;  /* next entry in the same bucket */
+    char uri[];
+}DISK_ENT;
+
+/* The log open, it is closed after compaction once no one sends from it */
+typedef struct{
+    int fd;
+    int refcnt;
+}LOGFILE;
+
+/* Work for the disk thread: append a line, or read a record back into memory */
+typedef struct{
+    CACHE *line;    /* to append, with a reference; NULL to read */
+    LOGFILE *log;   /* to read from, with a reference */
+    off_t off;
+    size_t size;
+    int keep;
+    char *uri;      /* of the record to read, Malloc'd */
+}DISK_JOB;
+
+/*
+ * The index is read by hits and changed by appends and compaction,
+ *      readers and writers as in a shard. Only the disk thread appends
+ *      and compacts, so it may read the index without the reader lock;
+ *      the others hand it jobs, and never wait for the disk
+ */
+typedef struct{
+    char path[MAXLINE];     /* dir/cache.log */
+    LOGFILE *log;   /* NULL without -d */
+    off_t end;      /* where the next record goes */
+    size_t limit;   /* bytes of the log that start compaction */
+    int nent;
+    DISK_ENT *bucket[NDBUCKET];
+    sem_t mutex;    /* lock for read_cnt */
     sem_t w;    /* lock for writer */
     int read_cnt;
-    int valid;
-}CACHE;
+    DISK_JOB jobs[DISK_QUEUE];  /* ring of jobs, as in sbuf */
+    int front, rear, njob;
+    sem_t qmutex;   /* lock for the ring */
+    sem_t items;    /* jobs in the ring */
+}DISK;
+
+/* How the end of a response body is found */
+#define BODY_NONE 0     /* 204, 304: there is no body */
+#define BODY_LENGTH 1   /* Content-Length */
+#define BODY_CHUNKED 2  /* Transfer-Encoding: chunked */
+#define BODY_EOF 3      /* the server closes the connection */
+
+/* Where a chunked body is */
+#define CH_SIZE 0       /* the hex size of a chunk */
+#define CH_EXT 1        /* the rest of the size line */
+#define CH_DATA 2       /* the data of a chunk */
+#define CH_DATA_END 3   /* the CRLF after the data */
+#define CH_TRAILER 4    /* start of a trailer line, or the last CRLF */
+#define CH_TRAILER_LINE 5
+
+/* The framing of a response body, and how much of it has gone by */
+typedef struct{
+    int mode;
+    int state;      /* CH_*, for BODY_CHUNKED */
+    size_t left;    /* bytes of the body, or of the chunk, to come */
+    int done;
+}BODY;
+
+/*
+ * A response being relayed by a leader: to its client with splice,
+ *      and into the line of its flight with tee
+ */
+typedef struct{
+    FLIGHT *f;
+    int clientfd;
+    int pipefd[2], teefd[2];
+    int alive;      /* the client is still there */
+    size_t size;    /* bytes relayed */
+}RELAY;
+
+/* States of a connection in the event loop */
+#define ST_REQUEST 0    /* reading the request from the client */
+#define ST_CONNECT 1    /* connecting to the server and sending the request */
+#define ST_RELAY 2      /* relaying the response to the client */
+#define ST_CACHED 3     /* sending a line of the cache */
+#define ST_CLOSED 4     /* freed after the events of this round */
+#define ST_DISK 5       /* sending a record of the log */
+
+struct CONN;
+
+/* One socket of a connection, what epoll hands back */
+typedef struct{
+    struct CONN *conn;
+    int fd;
+}END;
+
+/*
+ * A client in the event loop, driven by the events of its two sockets
+ */
+typedef struct CONN{
+    END client, server;
+    int state;
+    int eof;    /* the server has closed */
+    REQUEST rq;     /* request from the client */
+    char *uri;      /* key of the object, in rq or key */
+    char key[MAXLINE];
+    struct iovec iov[MAX_IOV];  /* request to the server, iov_first is next */
+    int iovcnt, iov_first;
+    char out[MAXLINE];  /* part of the response */
+    size_t out_len, out_off;
+    CACHE *fill;    /* the response for the cache, NULL once too large */
+    char *data;     /* the part of the response being sent, in out or fill */
+    CACHE *line;    /* the line sent on a hit */
+    CHUNK *chunk;   /* and where in it */
+    size_t chunk_skip;
+    LOGFILE *log;   /* the log sent from on a disk hit */
+    off_t disk_off;
+    size_t disk_left;
+    METER m;    /* m.start is 0 until the request is in */
+    unsigned long connect_start;    /* 0 once connected */
+    struct CONN *next_closed;
+}CONN;
 
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
 void * thread(void * vargp);
-void doit(int fd);
-int parse_uri(char *uri, Request_Line *linep);
-void read_requesthdrs(rio_t *r, int fd, 
-        Request_Line *linep, char *request_data);
-void send_content(int serverfd, int clientfd, char *uri);
+void idle_init();
+void idle_park(int fd);
+void * idler(void * vargp);
+int doit(REQUEST *rq, int fd);
+void request_init(REQUEST *rq);
+int read_request(int fd, REQUEST *rq);
+int parse_request(REQUEST *rq);
+int parse_uri(REQUEST *rq, Request_Line *linep);
+char *request_key(REQUEST *rq, char *key);
+int make_request(REQUEST *rq, Request_Line *linep, struct iovec *iov, int keep);
+int send_request(int fd, struct iovec *iov, int cnt);
+void iov_skip(struct iovec *iov, int *first, size_t n);
+int send_content(int serverfd, int clientfd, FLIGHT *f, int *reuse);
+int read_resphdrs(int serverfd, char *buf, size_t *np, BODY *b, int *reuse);
+size_t body_scan(BODY *b, char *buf, size_t n);
+CACHE *relay_room(RELAY *r, size_t n);
+void relay_publish(RELAY *r, CACHE *line);
+int relay_bytes(RELAY *r, char *buf, size_t n);
+ssize_t relay_splice(RELAY *r, int serverfd, size_t max);
+int relay_open(RELAY *r);
+void relay_close(RELAY *r);
 void lock_init();
-int reader(int fd, char *uri);
-void writer(char *buf, char *uri, size_t size);
-int find_LRU();
+unsigned int hash_uri(char *uri);
+CACHE *lookup(SHARD *sp, char *uri, unsigned int hash);
+CACHE *cache_get(char *uri);
+int reader(int fd, char *uri, int *keep);
+CACHE *new_line();
+char *line_room(CACHE *line, size_t size, size_t *room);
+void seal_line(CACHE *line, char *uri, int trim);
+int send_line(int fd, CACHE *line);
+void writer(CACHE *line);
+void link_line(SHARD *sp, CACHE *line);
+CACHE *clock_victim(SHARD *sp);
+CACHE *evict(SHARD *sp);
+void epoch_init();
+void retire_line(CACHE *line);
+void reclaim_lines();
+void sketch_add(unsigned int hash);
+int sketch_freq(unsigned int hash);
+unsigned int sketch_index(unsigned int hash, int row);
+void put_line(CACHE *line);
+void free_line(CACHE *line);
+CHUNK *chunk_get();
+void chunk_put(CHUNK *c);
+int chunk_iov(CHUNK *c, size_t skip, size_t len, struct iovec *iov);
+void chunk_skip(CHUNK **cp, size_t *skipp, size_t n);
+ssize_t send_chunks(int fd, CHUNK **cp, size_t *skipp, size_t len);
+FLIGHT *flight_join(char *uri, CACHE **linep, int *leader);
+int flight_follow(FLIGHT *f, int fd);
+void flight_trim(FLIGHT *f, size_t *lowp);
+void flight_finish(FLIGHT *f, int done);
+void flight_close(FLIGHT *f);
+void flight_leave(FLIGHT *f);
+ORIGIN *find_origin(char *host, char *port);
+int origin_connect(char *host, char *port, int *reused);
+void origin_release(char *host, char *port, int fd);
+void disk_init(char *dir, size_t limit);
+DISK_ENT *disk_find(char *uri, unsigned int hash);
+void disk_index(char *uri, DISK_REC *rec, off_t off);
+void disk_put(CACHE *line);
+LOGFILE *disk_get(char *uri, DISK_ENT *ent);
+int disk_reader(int fd, char *uri, int *keep);
+void disk_promote(LOGFILE *log, DISK_ENT *ent, char *uri);
+int disk_submit(DISK_JOB *job);
+void * disk_worker(void * vargp);
+void disk_append(CACHE *line);
+void disk_load(DISK_JOB *job);
+void disk_compact();
+int cmp_newest(const void *a, const void *b);
+void log_put(LOGFILE *log);
+unsigned long now_us();
+void stats_init();
+void stat_add(unsigned long *p, unsigned long n);
+void hist_add(HIST *h, unsigned long us);
+int hist_bucket(unsigned long us);
+unsigned long hist_value(int b);
+unsigned long hist_quantile(HIST *h, double q);
+void meter_start(METER *m);
+void meter_sent(METER *m, size_t n);
+void meter_done(METER *m);
+void stats_sum(STATS *sum);
+int metrics_page(char *buf, size_t size);
+void log_request(char *fmt, ...);
+void * logger(void * vargp);
+void * event_loop(void * vargp);
+int open_reuseport_listenfd(char *port);
+int open_nonblock_clientfd(char *hostname, char *port);
+void set_events(int epfd, END *ep, int op, unsigned int events);
+void accept_conns(int epfd, int listenfd);
+void client_event(int epfd, CONN *c, unsigned int events);
+void server_event(int epfd, CONN *c, unsigned int events);
+void start_request(int epfd, CONN *c);
+void flush_client(int epfd, CONN *c);
+void close_conn(CONN *c);
 
-CACHE cache[MAX_CACHE_NUM];
+SHARD shard[NSHARD];
+size_t shard_size = SHARD_SIZE;     /* -c bytes / NSHARD */
+size_t max_object = MAX_OBJECT_SIZE;    /* -m, larger ones are not cached */
+CHUNK *chunk_pool;  /* free chunks */
+int chunk_nfree;
+sem_t chunk_mutex;  /* lock for chunk_pool */
+SKETCH sketch;  /* zero at the start, as a global */
+sbuf_t sbuf;    /* Shared buffer of connected descriptors */
+int idle_epfd;  /* idle clients, watched by the idler */
+IDLE *idle_head, *idle_tail;
+sem_t idle_mutex;   /* lock for the list of idle clients */
+ORIGIN *origin[NORIGIN];
+sem_t origin_mutex;     /* lock for origin and everything in it */
+DISK disk;
+STATS *stats_list;  /* counters of every thread */
+sem_t stats_mutex;  /* lock for stats_list */
+__thread STATS *stats;  /* counters of this thread */
+__thread METER *meter;  /* request of this worker thread being timed */
+__thread int relay_pipes[4] = {-1, -1, -1, -1};    /* splice and tee pipes of this thread */
+unsigned long epoch_now = 1;    /* moved on by every retired line */
+EPOCH *epoch_list;  /* lookups of every thread */
+sem_t epoch_mutex;  /* lock for joining epoch_list */
+__thread EPOCH *my_epoch;   /* lookup of this thread */
+CACHE *retired;     /* evicted lines, put once no lookup can see them */
+sem_t retire_mutex; /* lock for retired */
+int logging = 0;    /* -l */
+LOGRING logring;
 
 int main(int argc, char ** argv){
     signal(SIGPIPE, SIG_IGN);   /* ignore SIGPIPE */
-    int  listenfd;
-    int *connfdp;    /* Use pointer to avoid race */  
+    int  listenfd, connfd;
     pthread_t tid;
+    struct timeval tv = {KEEPALIVE_TIMEOUT, 0};
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
     char hostname[MAXLINE], port[MAXLINE];
+    int opt, events = 0, nthreads = NTHREADS, sbufsize = SBUFSIZE, one = 1;
+    char *dir = NULL;
+    long limit = DISK_SIZE, cache = MAX_CACHE_SIZE, object = MAX_OBJECT_SIZE;
 
-    if(argc != 2){
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while((opt = getopt(argc, argv, "elc:m:d:D:n:q:")) != -1){
+        switch(opt){
+            case 'e': events = 1; break;
+            case 'l': logging = 1; break;
+            case 'c': cache = atol(optarg); break;
+            case 'm': object = atol(optarg); break;
+            case 'd': dir = optarg; break;
+            case 'D': limit = atol(optarg); break;
+            case 'n': nthreads = atoi(optarg); break;
+            case 'q': sbufsize = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-e] [-l] [-c cache bytes] [-m object bytes] [-d dir] [-D bytes] [-n threads] [-q queue] <port>\n", argv[0]);
+                exit(1);
+        }
+    }
+    /* a line of the largest object must fit in a shard */
+    if(optind != argc - 1 || nthreads <= 0 || sbufsize <= 0 || limit <= 0 ||
+            object <= 0 || cache / NSHARD < object + 2 * MAXLINE){
+        fprintf(stderr, "usage: %s [-e] [-l] [-c cache bytes] [-m object bytes] [-d dir] [-D bytes] [-n threads] [-q queue] <port>\n", argv[0]);
+        fprintf(stderr, "    -c must be at least %d times -m\n", NSHARD);
         exit(1);
     }
+    shard_size = cache / NSHARD;
+    max_object = object;
 
     lock_init();
+    /* -l: log every request, from a thread of its own */
+    if(logging)
+        Pthread_create(&tid, NULL, logger, NULL);
+    /* -d: a second tier of the cache on disk, warm from the last run */
+    disk.log = NULL;
+    if(dir != NULL)
+        disk_init(dir, limit);
+    /* -e: one event loop per core, each with its own listening socket */
+    if(events){
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        for(long i = 1; i < ncpu; i++){
+            Pthread_create(&tid, NULL, event_loop, argv[optind]);
+        }
+        event_loop(argv[optind]);
+    }
     /* create a listenfd and prepare for connection */
-    listenfd = Open_listenfd(argv[1]);
-    /* from textbook p695 picture 12-14 and tiny.c */
+    listenfd = Open_listenfd(argv[optind]);
+    /* prethreaded, from textbook p709 picture 12-28 */
+    sbuf_init(&sbuf, sbufsize);
+    idle_init();
+    for(int i = 0; i < nthreads; i++){
+        Pthread_create(&tid, NULL, thread, NULL);
+    }
     while(1){
         clientlen = sizeof(struct sockaddr_storage);
-        connfdp = Malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Getnameinfo((SA *) &clientaddr, clientlen, 
-                hostname, MAXLINE, port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
-        Pthread_create(&tid, NULL, thread, connfdp);
+        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        /* headers and body go in separate writes, Nagle would hold the body */
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        /* a client that stops reading holds the leader of its flight */
+        setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if(logging){
+            Getnameinfo((SA *) &clientaddr, clientlen, 
+                    hostname, MAXLINE, port, MAXLINE, 0);
+            log_request("Accepted connection from (%s, %s)\n", hostname, port);
+        }
+        /* waits here while every worker is busy and the buffer is full */
+        sbuf_insert(&sbuf, connfd);
     }
 
     return 0;
 }
 
 /* 
- * Use thread to handle concurrency.
+ * Use a pool of threads to handle concurrency.
  * Most important is to detach this thread.
- * From textbook p695 picture 12-14
+ * From textbook p709 picture 12-28
+ *      a client is served request after request while it sends them,
+ *      once it has nothing more it waits in the idler, not in this thread;
+ *      a request sent in parts may hold it KEEPALIVE_TIMEOUT at most
  */
 void * thread(void * vargp){
-    int connfd = *((int*) vargp);
+    struct timeval tv = {KEEPALIVE_TIMEOUT, 0};
+    REQUEST rq;
+    Pthread_detach(pthread_self());
+    stats_init();
+    while(1){
+        int connfd = sbuf_remove(&sbuf);
+        setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        request_init(&rq);
+        while(doit(&rq, connfd)){
+            /* nothing of the next request read yet */
+            if(rq.pos == rq.len){
+                idle_park(connfd);
+                connfd = -1;
+                break;
+            }
+        }
+        if(connfd >= 0)
+            Close(connfd);
+    }
+    return NULL;
+}
+
+/* Create an empty, bounded, shared FIFO buffer with n slots */
+void sbuf_init(sbuf_t *sp, int n){
+    sp->buf = Calloc(n, sizeof(int));
+    sp->n = n;
+    sp->front = sp->rear = 0;
+    Sem_init(&sp->mutex, 0, 1);
+    Sem_init(&sp->slots, 0, n);
+    Sem_init(&sp->items, 0, 0);
+}
+
+/* Insert item onto the rear of shared buffer sp */
+void sbuf_insert(sbuf_t *sp, int item){
+    P(&sp->slots);
+    P(&sp->mutex);
+    sp->buf[(++sp->rear) % (sp->n)] = item;
+    V(&sp->mutex);
+    V(&sp->items);
+}
+
+/* Remove and return the first item from buffer sp */
+int sbuf_remove(sbuf_t *sp){
+    int item;
+    P(&sp->items);
+    P(&sp->mutex);
+    item = sp->buf[(++sp->front) % (sp->n)];
+    V(&sp->mutex);
+    V(&sp->slots);
+    return item;
+}
+
+/*
+ * The idler waits for the next requests of keep-alive clients,
+ *      one epoll set for all of them, so they hold no worker meanwhile
+ */
+void idle_init(){
+    pthread_t tid;
+    if((idle_epfd = epoll_create1(0)) < 0)
+        unix_error("epoll_create1 error");
+    idle_head = idle_tail = NULL;
+    Sem_init(&idle_mutex, 0, 1);
+    Pthread_create(&tid, NULL, idler, NULL);
+}
+
+/*
+ * Hand a client to the idler until it sends more
+ */
+void idle_park(int fd){
+    struct epoll_event ev;
+    IDLE *ip = Malloc(sizeof(IDLE));
+
+    ip->fd = fd;
+    ip->since = time(NULL);
+    ip->next = NULL;
+    P(&idle_mutex);
+    ip->prev = idle_tail;
+    if(idle_tail != NULL)
+        idle_tail->next = ip;
+    else
+        idle_head = ip;
+    idle_tail = ip;
+    V(&idle_mutex);
+    ev.events = EPOLLIN;
+    ev.data.ptr = ip;
+    if(epoll_ctl(idle_epfd, EPOLL_CTL_ADD, fd, &ev) < 0){
+        /* the idler will close it when it expires */
+        log_request("epoll_ctl error\n");
+    }
+}
+
+/*
+ * Clients that sent something go back to the workers through sbuf,
+ *      clients idle for KEEPALIVE_TIMEOUT are closed
+ */
+void * idler(void * vargp){
+    struct epoll_event events[MAX_EVENTS];
+    IDLE *ip, *expired;
+    int n;
+
     Pthread_detach(pthread_self());
-    Free(vargp);
-    doit(connfd);
-    Close(connfd);
+    while(1){
+        n = epoll_wait(idle_epfd, events, MAX_EVENTS, 1000);
+        for(int i = 0; i < n; i++){
+            ip = events[i].data.ptr;
+            epoll_ctl(idle_epfd, EPOLL_CTL_DEL, ip->fd, NULL);
+            P(&idle_mutex);
+            if(ip->prev != NULL)
+                ip->prev->next = ip->next;
+            else
+                idle_head = ip->next;
+            if(ip->next != NULL)
+                ip->next->prev = ip->prev;
+            else
+                idle_tail = ip->prev;
+            V(&idle_mutex);
+            /* a worker reads the request, or finds it closed */
+            sbuf_insert(&sbuf, ip->fd);
+            Free(ip);
+        }
+        /* the oldest ones are first, cut them off the head */
+        P(&idle_mutex);
+        expired = idle_head;
+        while(idle_head != NULL && 
+                time(NULL) - idle_head->since >= KEEPALIVE_TIMEOUT){
+            idle_head = idle_head->next;
+        }
+        if(idle_head != NULL && idle_head != expired){
+            idle_head->prev->next = NULL;
+            idle_head->prev = NULL;
+        }
+        else if(idle_head == NULL){
+            idle_tail = NULL;
+        }
+        if(idle_head == expired)
+            expired = NULL;
+        V(&idle_mutex);
+        while(expired != NULL){
+            ip = expired;
+            expired = ip->next;
+            Close(ip->fd);  /* and out of the epoll set */
+            Free(ip);
+        }
+    }
     return NULL;
 }
 
 /*
  * To read the request and send them to the server.
+ *      return 1 if the client may send another request
  */
-void doit(int fd){
+int doit(REQUEST *rq, int fd){
     /* read the request lines and request headers */
     Request_Line line;
-    rio_t rio;
-    int serverfd;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char request_data[MAXLINE];
-
-    Rio_readinitb(&rio, fd);
-    Rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, uri, version);
-    if(strcasecmp(method, "GET")){
-        fprintf(stdout, "Not implemented\n");
-        fflush(stdout);
-        return;
+    int serverfd, leader, keep, reused, reuse, done = 0, iovcnt;
+    FLIGHT *f;
+    CACHE *hit;
+    char *uri, page[MAXLINE], key[MAXLINE];
+    struct iovec iov[MAX_IOV];
+    unsigned long t;
+    METER m;
+
+    /* the client has left, idled too long, or sent too much */
+    if(read_request(fd, rq) <= 0)
+        return 0;
+    if(strcasecmp(rq->buf + rq->method.off, "GET")){
+        log_request("Not implemented\n");
+        return 0;
     }
+    uri = rq->buf + rq->uri.off;
+    keep = rq->keep;
+    if(!strcmp(uri, METRICS_PATH)){
+        t = metrics_page(page, MAXLINE);
+        return rio_writen(fd, page, t) == (ssize_t)t && keep;
+    }
+    uri = request_key(rq, key);
+    meter_start(&m);
+    meter = &m;
+    sketch_add(hash_uri(uri));
     /* hit and return */
-    if(reader(fd, uri)){
-        fprintf(stdout, "%s from cache hit\n", uri);
-        fflush(stdout);
-        return;
+    if(reader(fd, uri, &done)){
+        log_request("%s from cache hit\n", uri);
+        m.kind = M_HIT;
+        goto out;
+    }
+    if(disk_reader(fd, uri, &done)){
+        log_request("%s from disk hit\n", uri);
+        m.kind = M_DISK;
+        goto out;
     }
     /* miss and write */
-    fprintf(stdout, "%s miss\n", uri);
-    fflush(stdout);
+    log_request("%s miss\n", uri);
+
+    /* only one thread fetches a uri, the others wait for its response */
+    if((f = flight_join(uri, &hit, &leader)) == NULL){
+        /* written just now */
+        meter_sent(&m, hit->size);
+        done = send_line(fd, hit) && hit->keep;
+        put_line(hit);
+        m.kind = M_HIT;
+        goto out;
+    }
+    if(!leader){
+        done = flight_follow(f, fd);
+        flight_leave(f);
+        m.kind = M_WAIT;
+        goto out;
+    }
     
     Request_Line *linep = &line;
-    if(parse_uri(uri, linep)){
-        fprintf(stdout, "Uri too long\n");
-        fflush(stdout);
-        return;
+    if(parse_uri(rq, linep)){
+        log_request("Bad uri\n");
+        flight_finish(f, -1);
+        flight_leave(f);
+        goto out;
     }
-    serverfd = Open_clientfd(linep->host, linep->port);
-    if(serverfd <= 0){
-        fprintf(stdout, "Connection failed\n");
-        fflush(stdout);
-        return;
+    while(1){
+        t = now_us();
+        serverfd = origin_connect(linep->host, linep->port, &reused);
+        if(serverfd < 0){
+            log_request("Connection failed\n");
+            flight_finish(f, -1);
+            flight_leave(f);
+            done = 0;
+            goto out;
+        }
+        if(!reused)
+            hist_add(&stats->connect, now_us() - t);
+        /* the iovecs are used up by writing, make them for every try */
+        iovcnt = make_request(rq, linep, iov, rq->http11);
+        if(send_request(serverfd, iov, iovcnt) == 0 && 
+                (done = send_content(serverfd, fd, f, &reuse)) >= 0)
+            break;
+        /* an idle connection the server closed meanwhile, try another one */
+        close(serverfd);
+        if(!reused){
+            flight_finish(f, -1);
+            flight_leave(f);
+            done = 0;
+            goto out;
+        }
     }
-    
-    read_requesthdrs(&rio, serverfd, linep, request_data);
-    
-    send_content(serverfd, fd, uri);
+    flight_leave(f);
+    m.kind = M_MISS;
 
-    Close(serverfd);
+    /* asked with HTTP/1.0 and Connection: close, the server closes it */
+    if(reuse && rq->http11)
+        origin_release(linep->host, linep->port, serverfd);
+    else
+        Close(serverfd);
 
-    return;
+out:
+    meter_done(&m);
+    meter = NULL;
+    return keep && done;
 }
 
 /*
- * First read the request line, then read the request header.
+ * An empty request, nothing read
  */
-int parse_uri(char *uri, Request_Line *linep){
-    /* default port number is 80 */
-    sprintf(linep->port, "80");
+void request_init(REQUEST *rq){
+    rq->len = rq->pos = 0;
+    rq->state = RQ_LINE;
+    rq->host.len = 0;
+    rq->nhdr = 0;
+    rq->keep = 0;
+    rq->http11 = 0;
+}
 
-    char *end, *fst;
-    char *tail = uri + strlen(uri);   
-    /* ignore http:// */
-    char *head = strstr(uri, "//");
-    head = (head != NULL ? head + 2 : uri); 
-    end = head;                        
-    while(*end != '/' && *end != ':') end++;
-    strncpy(linep->host, head, end - head);
-    fst = end + 1;  
-    /* if uri has port number */                
-    if(*end == ':'){               
-        end++;
-        fst = strstr(head,"/");        
-        strncpy(linep->port, end, fst - end);   
-        end = fst;                   
-    }
-    if((int)(tail - end) > MAXLINE)
-        return 1;
-    strncpy(linep->path, end, (int)(tail - end) + 1);
-    
-    return 0;
+/*
+ * Read the next request of a client into rq, 
+ *      the bytes read after the last one are the start of it.
+ * Return 1 once it is all in, 0 if the client left, -1 if it is bad.
+ */
+int read_request(int fd, REQUEST *rq){
+    ssize_t n;
+    int rc;
+
+    if(rq->state == RQ_DONE){
+        n = rq->len - rq->pos;
+        memmove(rq->buf, rq->buf + rq->pos, n);
+        request_init(rq);
+        rq->len = n;
+    }
+    while((rc = parse_request(rq)) == 0){
+        if(rq->len == MAXLINE)      /* too long */
+            return -1;
+        if((n = read(fd, rq->buf + rq->len, MAXLINE - rq->len)) <= 0)
+            return 0;
+        rq->len += n;
+    }
+    return rc;
 }
 
 /*
- * Parse the headers.
+ * Parse the lines of rq read so far, in one pass: every line is looked at
+ *      once, where it was read, and kept as a slice.
+ *      Keep Host, drop Connection, Proxy-Connection, Keep-Alive and 
+ *      User-Agent, the others are passed on as they are.
+ * Return 1 once the blank line after the headers is in, 
+ *      0 if more is needed, -1 if it is bad.
  */
-void read_requesthdrs(rio_t *rp, int fd, 
-        Request_Line *linep, char *request_data){
-    char buf[MAXLINE];
-    char Reqline[MAXLINE], Host_hdr[MAXLINE], Other_hdr[MAXLINE];
-    char *p = Other_hdr, *p1 = Reqline, *p2 = Host_hdr;
-    sprintf(p1, "GET %s HTTP/1.0\r\n", linep->path);
-    while (Rio_readlineb(rp, buf, MAXLINE) != 0){
-        if (strcmp(buf, "\r\n") == 0){
-            strcpy(p, "\r\n");
-            break;          
+int parse_request(REQUEST *rq){
+    char *line, *eol, *p, *q;
+    size_t len;
+
+    while((eol = memchr(rq->buf + rq->pos, '\n', rq->len - rq->pos)) != NULL){
+        line = rq->buf + rq->pos;
+        len = eol + 1 - line;
+        if(rq->state == RQ_LINE){
+            /* method uri version, each ended in place */
+            if((q = memchr(line, ' ', len)) == NULL)
+                return -1;
+            rq->method = (SLICE){line - rq->buf, q - line};
+            *q = '\0';
+            p = q + 1;
+            if((q = memchr(p, ' ', eol - p)) == NULL)
+                return -1;
+            rq->uri = (SLICE){p - rq->buf, q - p};
+            *q = '\0';
+            p = q + 1;
+            q = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+            rq->version = (SLICE){p - rq->buf, q - p};
+            *q = '\0';
+            /* HTTP/1.1 clients stay unless they say close, the others leave */
+            rq->http11 = rq->keep = !strcasecmp(p, "HTTP/1.1");
+            rq->state = RQ_HDRS;
+        }
+        else if(line[0] == '\n' || (line[0] == '\r' && len == 2)){
+            rq->pos += len;
+            rq->state = RQ_DONE;
+            return 1;
         }
-        else if (strncmp(buf, "Host:", 5) == 0){
-            strcpy(Host_hdr, buf);
+        else if(!strncasecmp(line, "Host:", 5)){
+            rq->host = (SLICE){line - rq->buf, len};
         }
-        else if (strncmp(buf, "Connection:", 11) 
-                && strncmp(buf, "Proxy_Connection:", 17) 
-                && strncmp(buf, "User-agent:", 11)){
-            strcpy(p, buf);
-            p = Other_hdr + strlen(Other_hdr);
+        else if(!strncasecmp(line, "Connection:", 11) || 
+                !strncasecmp(line, "Proxy-Connection:", 17)){
+            *eol = '\0';   /* not passed on, so it may be ended in place */
+            /* 
+             * a 1.0 client that stays needs Connection: keep-alive in every
+             *      response, cached ones too, which are sent as they are:
+             *      it is closed after the response instead
+             */
+            if(strcasestr(line, "close"))
+                rq->keep = 0;
+            else if(strcasestr(line, "keep-alive") && rq->http11)
+                rq->keep = 1;
         }
+        else if(strncasecmp(line, "Keep-Alive:", 11) && 
+                strncasecmp(line, "User-Agent:", 11)){
+            /* the number of lines is bounded, not their bytes */
+            if(rq->nhdr == MAX_HDRS)
+                return -1;
+            rq->hdr[rq->nhdr++] = (SLICE){line - rq->buf, len};
+        }
+        rq->pos += len;
+    }
+    return 0;
+}
+
+/*
+ * Split the uri of rq into host, port and path.
+ *      the path and the host name are slices of the uri,
+ *      host and port are copied out, to connect with them
+ */
+int parse_uri(REQUEST *rq, Request_Line *linep){
+    char *uri = rq->buf + rq->uri.off, *end = uri + rq->uri.len;
+    char *head, *p, *colon = NULL;
+
+    /* ignore http:// */
+    head = strstr(uri, "//");
+    head = (head != NULL ? head + 2 : uri);
+    for(p = head; p < end && *p != '/'; p++){
+        if(*p == ':')
+            colon = p;
+    }
+    linep->name = (SLICE){head - rq->buf, p - head};
+    linep->path = (SLICE){p - rq->buf, end - p};
+    if(colon == NULL)
+        colon = p;
+    if(colon == head)
+        return 1;
+    memcpy(linep->host, head, colon - head);
+    linep->host[colon - head] = '\0';
+    /* default port number is 80 */
+    if(colon + 1 >= p){
+        strcpy(linep->port, "80");
     }
+    else{
+        memcpy(linep->port, colon + 1, p - colon - 1);
+        linep->port[p - colon - 1] = '\0';
+    }
+    return 0;
+}
+
+/*
+ * The key of the object a request asks for, its uri for HTTP/1.1 clients.
+ *      A 1.0 client can not take a chunked body: its request goes to 
+ *      the server as HTTP/1.0, and the response is cached apart, 
+ *      under "uri version" written into key, MAXLINE bytes
+ */
+char *request_key(REQUEST *rq, char *key){
+    if(rq->http11)
+        return rq->buf + rq->uri.off;
+    /* both were in the request line, which fit in rq->buf */
+    sprintf(key, "%s %s", rq->buf + rq->uri.off, rq->buf + rq->version.off);
+    return key;
+}
+
+#define IOV_STR(s)  ((struct iovec){(char *)(s), strlen(s)})
+#define IOV_SLICE(rq, s)    ((struct iovec){(rq)->buf + (s).off, (s).len})
+
+/*
+ * Put the request to the server together, as iovecs for writev: 
+ *      the parts of rq and the headers of the proxy, nothing is formatted.
+ *      with keep, ask for HTTP/1.1 and a connection that stays open,
+ *      so it can go back to the pool of its origin after the response.
+ * Return the number of iovecs, at most MAX_IOV.
+ */
+int make_request(REQUEST *rq, Request_Line *linep, struct iovec *iov, int keep){
+    int n = 0;
+
+    iov[n++] = IOV_STR("GET ");
+    iov[n++] = linep->path.len ? IOV_SLICE(rq, linep->path) : IOV_STR("/");
+    iov[n++] = IOV_STR(keep ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n");
     /* use the default host header */
-    if (!strlen(Host_hdr)){
-        sprintf(p2, "Host: %s\r\n", linep->host); 
+    if(rq->host.len){
+        iov[n++] = IOV_SLICE(rq, rq->host);
+    }
+    else{
+        iov[n++] = IOV_STR("Host: ");
+        iov[n++] = IOV_SLICE(rq, linep->name);
+        iov[n++] = IOV_STR("\r\n");
+    }
+    if(keep){
+        iov[n++] = IOV_STR(Keep_hdr);
+    }
+    else{
+        iov[n++] = IOV_STR(Con_hdr);
+        iov[n++] = IOV_STR(P_Con_hdr);
+    }
+    iov[n++] = IOV_STR(user_agent_hdr);
+    for(int i = 0; i < rq->nhdr; i++){
+        iov[n++] = IOV_SLICE(rq, rq->hdr[i]);
+    }
+    iov[n++] = IOV_STR("\r\n");
+    return n;
+}
+
+/*
+ * Write the whole request, return -1 if the server is gone
+ */
+int send_request(int fd, struct iovec *iov, int cnt){
+    int first = 0;
+    ssize_t n;
+
+    while(first < cnt){
+        if((n = writev(fd, iov + first, cnt - first)) < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        iov_skip(iov, &first, n);
+    }
+    return 0;
+}
+
+/*
+ * n bytes of the iovecs from *first on are written, move past them
+ */
+void iov_skip(struct iovec *iov, int *first, size_t n){
+    while(n > 0){
+        if(n < iov[*first].iov_len){
+            iov[*first].iov_base = (char *)iov[*first].iov_base + n;
+            iov[*first].iov_len -= n;
+            return;
+        }
+        n -= iov[(*first)++].iov_len;
     }
-    sprintf(request_data, "%s%s%s%s%s%s", Reqline, 
-        Host_hdr, Con_hdr, P_Con_hdr, user_agent_hdr, Other_hdr);
-    Rio_writen(fd, request_data, strlen(request_data));
-    return;
 }
 
 /*
  * Send the data to the client.
  * Warning: files might be binary.
+ *      the body never enters user space on its way: splice moves it
+ *      from the server into a pipe and from the pipe to the client;
+ *      while it may still be cached or others wait for it, tee copies 
+ *      the pipe to a second one, which is read straight into the line of f.
+ *      Only the headers, and the size lines of a chunked body, are read.
+ * Return 1 if the response was sent whole and has its own length,
+ *      -1 if the server closed before sending anything, 0 otherwise;
+ *      *reuse is set if the server connection may serve another request
  */
-void send_content(int serverfd, int clientfd, char *uri){
-    size_t n,size = 0;
-    char buf[MAXLINE], content[MAX_OBJECT_SIZE];
-    rio_t srio;
+int send_content(int serverfd, int clientfd, FLIGHT *f, int *reuse){
+    ssize_t n;
+    size_t k;
+    int ok = 1;
+    char buf[MAXLINE];
+    BODY b;
+    RELAY r = {f, clientfd, {-1, -1}, {-1, -1}, 1, 0};
 
-    Rio_readinitb(&srio,serverfd);
-/* use Rio_readnb instead of Rio_readlineb, as the file might be binary */
-    while((n = Rio_readnb(&srio,buf,MAXLINE)) > 0){
-        Rio_writen(clientfd, buf, n);
-        if(n + size <= MAX_OBJECT_SIZE){
-            /* use memcpy instead of strcpy */
-            memcpy(content + size, buf, n);
+    *reuse = 0;
+    if(read_resphdrs(serverfd, buf, &k, &b, reuse) < 0)
+        return -1;
+    if(!relay_open(&r))
+        ok = 0;
+    /* the headers, and the part of the body read with them */
+    n = strstr(buf, "\r\n\r\n") ? strstr(buf, "\r\n\r\n") + 4 - buf : k;
+    ok = ok && relay_bytes(&r, buf, n + body_scan(&b, buf + n, k - n));
+    while(ok && !b.done){
+        if(b.mode != BODY_CHUNKED || b.state == CH_DATA){
+            n = relay_splice(&r, serverfd, b.mode == BODY_EOF ? PIPE_SIZE : 
+                    (b.left < PIPE_SIZE ? b.left : PIPE_SIZE));
+            if(n == 0 && b.mode == BODY_EOF)
+                b.done = 1;
+            else if(n <= 0)
+                ok = 0;
+            else    /* all of it is data, body_scan never looks at it */
+                body_scan(&b, NULL, n);
+        }
+        else if((n = read(serverfd, buf, MAXLINE)) <= 0){
+            ok = 0;
+        }
+        else{
+            k = body_scan(&b, buf, n);
+            /* more than the response, the connection is out of step */
+            if(k < (size_t)n)
+                *reuse = 0;
+            ok = relay_bytes(&r, buf, k);
         }
-        size += n;
     }
-    /* write to cache if possible */
-    if(size <= MAX_OBJECT_SIZE)
-        writer(content, uri, size);
+    if(!ok)
+        relay_close(&r);
+    /* write to cache if possible, only a complete response */
+    f->keep = b.mode != BODY_EOF;
+    flight_finish(f, ok ? 1 : -1);
+    *reuse = *reuse && ok;
+    return ok && r.alive && f->keep;
 }
 
 /*
- * Initialize the lock and cache.
+ * Read the status line and headers of a response into buf, MAXLINE bytes,
+ *      *np bytes are read, which may be more than the headers.
+ *      Find how the body ends, and if the connection may be reused.
+ * Return -1 if the server closed before sending anything.
  */
-void lock_init(){
-    for(int i = 0; i < MAX_CACHE_NUM; i++){
-        cache[i].read_cnt = 0;
-        cache[i].valid = 0;
-        cache[i].LRU = 0;
-        sem_init(&cache[i].mutex, 0, 1);
-        sem_init(&cache[i].w, 0, 1);
+int read_resphdrs(int serverfd, char *buf, size_t *np, BODY *b, int *reuse){
+    ssize_t n;
+    size_t k = 0;
+    int status = 0, minor = 0;
+    char *p, *end, *eol;
+
+    do{
+        if((n = read(serverfd, buf + k, MAXLINE - 1 - k)) <= 0)
+            break;
+        k += n;
+        buf[k] = '\0';
+    }while(k < MAXLINE - 1 && !strstr(buf, "\r\n\r\n"));
+    if(k == 0)
+        return -1;
+    *np = k;
+    b->mode = BODY_EOF;
+    b->state = CH_SIZE;
+    b->left = 0;
+    b->done = 0;
+    /* headers too long, or cut: relay to the end and do not reuse */
+    if((end = strstr(buf, "\r\n\r\n")) == NULL)
+        return 0;
+    sscanf(buf, "HTTP/1.%d %d", &minor, &status);
+    *reuse = (minor == 1);
+    for(p = strstr(buf, "\r\n") + 2; p < end + 2; p = eol + 2){
+        eol = strstr(p, "\r\n");
+        *eol = '\0';   /* look at this line only */
+        if(!strncasecmp(p, "Content-Length:", 15) && b->mode == BODY_EOF){
+            b->mode = BODY_LENGTH;
+            b->left = strtoul(p + 15, NULL, 10);
+        }
+        else if(!strncasecmp(p, "Transfer-Encoding:", 18) && 
+                strcasestr(p, "chunked")){
+            b->mode = BODY_CHUNKED;
+            b->left = 0;
+        }
+        else if(!strncasecmp(p, "Connection:", 11) && strcasestr(p, "close")){
+            *reuse = 0;
+        }
+        *eol = '\r';
     }
+    if(status == 204 || status == 304 || (status >= 100 && status < 200))
+        b->mode = BODY_NONE;
+    b->done = (b->mode == BODY_NONE || (b->mode == BODY_LENGTH && !b->left));
+    if(b->mode == BODY_EOF)
+        *reuse = 0;
+    return 0;
 }
 
 /*
- * Readers and Writers problem. Use the model from ppt SYNC2. 
+ * Go over n bytes of a body, return how many of them are in it,
+ *      all of them unless it ends there. Bytes in CH_DATA are not looked at.
  */
-int reader(int fd, char *uri){
-    int hit = 0;
-    for(int i = 0; i < MAX_CACHE_NUM; i++){
-        P(&(cache[i].mutex));
-        if(++cache[i].read_cnt == 1){
-            P(&(cache[i].w));
-        }    
-        V(&(cache[i].mutex));
+size_t body_scan(BODY *b, char *buf, size_t n){
+    size_t i = 0, m;
+    int c, d;
 
-        /* reading happens here */
-        P(&(cache[i].mutex));
-        if(!hit && cache[i].valid && !strcmp(cache[i].uri, uri)){
-            Rio_writen(fd, cache[i].obj, MAX_OBJECT_SIZE);
-            cache[i].LRU = 0;
-            hit = 1;
+    while(i < n && !b->done){
+        if(b->mode == BODY_EOF)
+            return n;
+        if(b->mode == BODY_LENGTH || b->state == CH_DATA){
+            m = (n - i < b->left) ? n - i : b->left;
+            b->left -= m;
+            i += m;
+            if(b->left == 0 && b->mode == BODY_LENGTH)
+                b->done = 1;
+            else if(b->left == 0)
+                b->state = CH_DATA_END;
+            continue;
         }
-        else if(cache[i].valid){
-            ++cache[i].LRU;
+        c = buf[i++];
+        switch(b->state){
+            case CH_SIZE:
+                d = isdigit(c) ? c - '0' : (isxdigit(c) ? tolower(c) - 'a' + 10 : -1);
+                if(d >= 0){
+                    b->left = b->left * 16 + d;
+                    break;
+                }
+                b->state = CH_EXT;
+                /* fall through */
+            case CH_EXT:
+                if(c == '\n')
+                    b->state = b->left ? CH_DATA : CH_TRAILER;
+                break;
+            case CH_DATA_END:
+                if(c == '\n')
+                    b->state = CH_SIZE;
+                break;
+            case CH_TRAILER:
+                if(c == '\n')
+                    b->done = 1;
+                else if(c != '\r')
+                    b->state = CH_TRAILER_LINE;
+                break;
+            case CH_TRAILER_LINE:
+                if(c == '\n')
+                    b->state = CH_TRAILER;
+                break;
         }
-        V(&(cache[i].mutex));
-        /* end reading */
+    }
+    return i;
+}
 
-        P(&(cache[i].mutex));
-        if(--cache[i].read_cnt == 0){
-            V(&(cache[i].w));
-        }
-        V(&(cache[i].mutex));
+/*
+ * Return the line of r->f to add n more bytes to,
+ *      NULL once it is too large to be cached and no one else needs it.
+ *      Only the leader adds to the line, and it writes past line->size.
+ *      For the followers it keeps max_object bytes of it at most,
+ *      and waits while that is full and one of them is behind
+ */
+CACHE *relay_room(RELAY *r, size_t n){
+    FLIGHT *f = r->f;
+    CACHE *line;
+    size_t low;
+
+    /* too large to be cached, or the client is gone: no one else joins */
+    if(f->open && (r->size + n > max_object || !r->alive))
+        flight_close(f);
+    pthread_mutex_lock(&f->lock);
+    while(f->line != NULL && f->users > 1 && r->size + n - f->base > max_object){
+        flight_trim(f, &low);
+        if(r->size + n - f->base <= max_object || low == r->size)
+            break;
+        pthread_cond_wait(&f->sent, &f->lock);
     }
-    return hit;
+    if(f->line != NULL && f->users == 1 && 
+            (r->size + n > max_object || !r->alive)){
+        /* and no one waits for it */
+        put_line(f->line);
+        f->line = NULL;
+    }
+    line = f->line;
+    pthread_mutex_unlock(&f->lock);
+    return line;
 }
 
 /*
- * Find a cache line to write.
+ * Wake the waiting threads, size bytes of the line are in
  */
-void writer(char *buf, char *uri, size_t size){
-    int i = find_LRU();
-    P(&(cache[i].w));
-    cache[i].valid = 1;
-    cache[i].LRU = 0;
-    
-    /* writing happens here */
-    strcpy(cache[i].uri, uri);
-    memcpy(cache[i].obj, buf, size);
-    /* end writing */
-    
-    V(&(cache[i].w));
-    return;
+void relay_publish(RELAY *r, CACHE *line){
+    pthread_mutex_lock(&r->f->lock);
+    line->size = r->size;
+    pthread_cond_broadcast(&r->f->more);
+    pthread_mutex_unlock(&r->f->lock);
+}
+
+/*
+ * Relay n bytes read from the server, return 0 once no one needs them
+ */
+int relay_bytes(RELAY *r, char *buf, size_t n){
+    CACHE *line = relay_room(r, n);
+    size_t k, room;
+    char *p;
+
+    if(line == NULL && !r->alive)
+        return 0;
+    if(r->alive)
+        meter_sent(meter, n);
+    if(r->alive && rio_writen(r->clientfd, buf, n) != (ssize_t)n)
+        r->alive = 0;
+    if(line != NULL){
+        for(k = 0; k < n; k += room){
+            p = line_room(line, r->size + k, &room);
+            room = (room < n - k) ? room : n - k;
+            memcpy(p, buf + k, room);
+        }
+        r->size += n;
+        relay_publish(r, line);
+    }
+    else{
+        r->size += n;
+    }
+    return 1;
 }
 
 /*
- * To find the line to replace
+ * Splice up to max bytes from the server to the client, and tee them
+ *      into the line. Return the bytes, 0 at EOF, -1 once no one needs them
  */
-int find_LRU(){
-    int index, lru = 0;
-    for(int i = 0; i < MAX_CACHE_NUM && lru != -1; i++){
-        P(&(cache[i].mutex));
-        if(++cache[i].read_cnt == 1){
-            P(&(cache[i].w));
+ssize_t relay_splice(RELAY *r, int serverfd, size_t max){
+    ssize_t n, m, k;
+    size_t room;
+    char buf[MAXLINE], *p;
+    CACHE *line;
+
+    if((n = splice(serverfd, NULL, r->pipefd[1], NULL, max, SPLICE_F_MOVE)) <= 0)
+        return n;
+    if((line = relay_room(r, n)) == NULL && !r->alive)
+        return -1;
+    /* a copy for the cache and the waiting threads, chunk by chunk */
+    if(line != NULL){
+        m = r->alive ? tee(r->pipefd[0], r->teefd[1], n, 0) : n;
+        if(m != n)
+            return -1;
+        for(k = 0; k < n; k += room){
+            p = line_room(line, r->size + k, &room);
+            room = (room < (size_t)(n - k)) ? room : (size_t)(n - k);
+            if(rio_readn(r->alive ? r->teefd[0] : r->pipefd[0], p, room) != 
+                    (ssize_t)room)
+                return -1;
+        }
+    }
+    /* then the whole chunk goes to the client */
+    if(r->alive)
+        meter_sent(meter, n);
+    for(m = r->alive ? n : 0; m > 0; m -= k){
+        if((k = splice(r->pipefd[0], NULL, r->clientfd, NULL, m, 
+                SPLICE_F_MOVE)) <= 0){
+            r->alive = 0;
+            break;
         }
-        V(&(cache[i].mutex));
-        /* find a blank line */
-        if(!cache[i].valid){
-            index = i;
-            lru = -1;
+    }
+    /* the client is gone, the rest was copied already */
+    while(!r->alive && m > 0){
+        if((k = read(r->pipefd[0], buf, m < MAXLINE ? m : MAXLINE)) <= 0)
+            return -1;
+        m -= k;
+    }
+    r->size += n;
+    if(line != NULL)
+        relay_publish(r, line);
+    return n;
+}
+
+/*
+ * Give r the pipes of this thread, made by its first relay and kept for
+ *      the rest: two pipe() and four close() cost more than a small body.
+ * Return 0 if they cannot be made.
+ */
+int relay_open(RELAY *r){
+    if(relay_pipes[0] < 0){
+        if(pipe(relay_pipes) < 0)
+            return 0;
+        if(pipe(relay_pipes + 2) < 0){
+            close(relay_pipes[0]);
+            close(relay_pipes[1]);
+            relay_pipes[0] = relay_pipes[1] = -1;
+            return 0;
         }
-        /* find the greatest LRU */
-        else if(cache[i].LRU >= lru){
-            index = i;
-            lru = cache[i].LRU;
+    }
+    r->pipefd[0] = relay_pipes[0];
+    r->pipefd[1] = relay_pipes[1];
+    r->teefd[0] = relay_pipes[2];
+    r->teefd[1] = relay_pipes[3];
+    return 1;
+}
+
+/*
+ * A relay cut short may leave bytes in the pipes, which would go to the
+ *      next client. Read them out; if that fails, close the pipes and
+ *      the next relay makes new ones.
+ */
+void relay_close(RELAY *r){
+    char buf[MAXLINE];
+    int fd, n, k;
+
+    if(r->pipefd[0] < 0)
+        return;
+    for(int i = 0; i < 2; i++){
+        fd = i ? r->teefd[0] : r->pipefd[0];
+        if(ioctl(fd, FIONREAD, &n) < 0)
+            goto fail;
+        for(; n > 0; n -= k){
+            if((k = read(fd, buf, n < MAXLINE ? n : MAXLINE)) <= 0)
+                goto fail;
         }
-        P(&(cache[i].mutex));
-        if(--cache[i].read_cnt == 0){
-            V(&(cache[i].w));
+    }
+    return;
+fail:
+    for(int i = 0; i < 4; i++){
+        close(relay_pipes[i]);
+        relay_pipes[i] = -1;
+    }
+}
+
+/*
+ * Initialize the lock and cache.
+ */
+void lock_init(){
+    for(int i = 0; i < NSHARD; i++){
+        for(int j = 0; j < NBUCKET; j++){
+            shard[i].bucket[j] = NULL;
         }
-        V(&(cache[i].mutex));
+        shard[i].bytes = 0;
+        shard[i].hand = NULL;
+        shard[i].flights = NULL;
+        sem_init(&shard[i].w, 0, 1);
+        sem_init(&shard[i].fmutex, 0, 1);
     }
-    return index;
-}
\ No newline at end of file
+    for(int i = 0; i < NORIGIN; i++){
+        origin[i] = NULL;
+    }
+    chunk_pool = NULL;
+    chunk_nfree = 0;
+    sem_init(&chunk_mutex, 0, 1);
+    sem_init(&origin_mutex, 0, 1);
+    stats_list = NULL;
+    sem_init(&stats_mutex, 0, 1);
+    epoch_list = NULL;
+    sem_init(&epoch_mutex, 0, 1);
+    retired = NULL;
+    sem_init(&retire_mutex, 0, 1);
+    logring.head = logring.tail = logring.dropped = 0;
+    sem_init(&logring.mutex, 0, 1);
+    sem_init(&logring.lines, 0, 0);
+}
+
+/*
+ * FNV-1a, the shard is hash % NSHARD, the bucket comes from the rest
+ */
+unsigned int hash_uri(char *uri){
+    unsigned int hash = 2166136261u;
+    while(*uri){
+        hash ^= (unsigned char)*uri++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Find the line of uri in its bucket, hold the writer lock of the shard
+ *      or be in a lookup epoch
+ */
+CACHE *lookup(SHARD *sp, char *uri, unsigned int hash){
+    CACHE *line = __atomic_load_n(&sp->bucket[(hash / NSHARD) % NBUCKET], 
+            __ATOMIC_ACQUIRE);
+    for(; line != NULL; line = __atomic_load_n(&line->next, __ATOMIC_ACQUIRE)){
+        if(line->hash == hash && !strcmp(line->uri, uri))
+            return line;
+    }
+    return NULL;
+}
+
+/*
+ * A hit takes no lock and writes nothing shared but the line itself:
+ *      the thread marks the epoch it looks up in, in its own EPOCH, 
+ *      sets the reference bit and takes a reference with atomics.
+ *      A line evicted meanwhile still holds the reference of the cache, 
+ *      which is only put after every lookup of its epoch or before is over.
+ *      the caller sends the line without any lock and puts it
+ */
+CACHE *cache_get(char *uri){
+    unsigned int hash = hash_uri(uri);
+    SHARD *sp = &shard[hash % NSHARD];
+    CACHE *line;
+
+    if(my_epoch == NULL)
+        epoch_init();
+    __atomic_store_n(&my_epoch->epoch, __atomic_load_n(&epoch_now, __ATOMIC_RELAXED), 
+            __ATOMIC_RELAXED);
+    /* the epoch is seen by writers before any line is */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if((line = lookup(sp, uri, hash)) != NULL){
+        /* do not write the cache line again if it is set already */
+        if(!__atomic_load_n(&line->ref, __ATOMIC_RELAXED))
+            __atomic_store_n(&line->ref, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&line->refcnt, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&my_epoch->epoch, 0, __ATOMIC_RELEASE);
+    return line;
+}
+
+/*
+ * The EPOCH of the calling thread, joined to epoch_list
+ */
+void epoch_init(){
+    my_epoch = Calloc(1, sizeof(EPOCH));
+    P(&epoch_mutex);
+    my_epoch->next = epoch_list;
+    __atomic_store_n(&epoch_list, my_epoch, __ATOMIC_RELEASE);
+    V(&epoch_mutex);
+}
+
+/*
+ * An evicted line is out of its bucket, but a lookup may still be on it:
+ *      stamp it with the epoch now and move the epoch on, so later 
+ *      lookups are known not to see it
+ */
+void retire_line(CACHE *line){
+    P(&retire_mutex);
+    line->epoch = __atomic_fetch_add(&epoch_now, 1, __ATOMIC_SEQ_CST);
+    line->gone = retired;
+    /* writers look at retired without the lock */
+    __atomic_store_n(&retired, line, __ATOMIC_RELAXED);
+    V(&retire_mutex);
+}
+
+/*
+ * Put the retired lines older than every lookup going on; 
+ *      the others wait for the next writer
+ */
+void reclaim_lines(){
+    unsigned long oldest, n;
+    EPOCH *e;
+    CACHE *line, **pp, *done = NULL;
+
+    oldest = __atomic_load_n(&epoch_now, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for(e = __atomic_load_n(&epoch_list, __ATOMIC_ACQUIRE); e != NULL; e = e->next){
+        n = __atomic_load_n(&e->epoch, __ATOMIC_ACQUIRE);
+        if(n != 0 && n < oldest)
+            oldest = n;
+    }
+    P(&retire_mutex);
+    for(pp = &retired; (line = *pp) != NULL; ){
+        if(line->epoch < oldest){
+            __atomic_store_n(pp, line->gone, __ATOMIC_RELAXED);
+            line->gone = done;
+            done = line;
+        }
+        else
+            pp = &line->gone;
+    }
+    V(&retire_mutex);
+    while(done != NULL){
+        line = done;
+        done = line->gone;
+        put_line(line);
+    }
+}
+
+/*
+ * Send the line of uri if there is one.
+ *      *keep is set if it was sent whole and has its own length
+ */
+int reader(int fd, char *uri, int *keep){
+    CACHE *line = cache_get(uri);
+    if(line == NULL)
+        return 0;
+    /* the line stays alive until it is put, even if it is evicted */
+    meter_sent(meter, line->size);
+    *keep = send_line(fd, line) && line->keep;
+    put_line(line);
+    return 1;
+}
+
+/*
+ * An empty line, with one reference for its filler
+ */
+CACHE *new_line(){
+    CACHE *line = Malloc(sizeof(CACHE));
+    line->refcnt = 1;
+    line->keep = 0;
+    line->size = line->nchunk = 0;
+    line->uri = NULL;
+    line->head = line->tail = NULL;
+    return line;
+}
+
+/*
+ * Where the byte size of line goes, and *room bytes after it in its chunk;
+ *      a chunk is added once the last one is full. Only the filler calls it
+ */
+char *line_room(CACHE *line, size_t size, size_t *room){
+    CHUNK *c;
+    size_t used;
+
+    if(size == line->nchunk * CHUNK_SIZE){
+        c = chunk_get();
+        if(line->tail == NULL)
+            line->head = c;
+        else
+            line->tail->next = c;
+        line->tail = c;
+        line->nchunk++;
+    }
+    used = size - (line->nchunk - 1) * CHUNK_SIZE;
+    *room = CHUNK_SIZE - used;
+    return line->tail->data + used;
+}
+
+/*
+ * A line filled with line->size bytes is complete: add the uri, and 
+ *      with trim, when no one else sends it, give back the room 
+ *      the last chunk did not use
+ */
+void seal_line(CACHE *line, char *uri, int trim){
+    size_t used = line->size % CHUNK_SIZE;
+    CHUNK *c, **pp;
+
+    line->uri = Malloc(strlen(uri) + 1);
+    strcpy(line->uri, uri);
+    line->hash = hash_uri(uri);
+    if(trim && line->tail != NULL && used != 0){
+        c = Malloc(sizeof(CHUNK) + used);
+        c->next = NULL;
+        c->cap = used;
+        memcpy(c->data, line->tail->data, used);
+        for(pp = &line->head; *pp != line->tail; pp = &(*pp)->next)
+            ;
+        *pp = c;
+        chunk_put(line->tail);
+        line->tail = c;
+    }
+    line->bytes = sizeof(CACHE) + strlen(uri) + 1;
+    for(c = line->head; c != NULL; c = c->next){
+        line->bytes += sizeof(CHUNK) + c->cap;
+    }
+}
+
+/*
+ * Send a whole line, return 1 if it was all sent
+ */
+int send_line(int fd, CACHE *line){
+    CHUNK *c = line->head;
+    size_t skip = 0;
+    return send_chunks(fd, &c, &skip, line->size) == (ssize_t)line->size;
+}
+
+/*
+ * Put a sealed line into the cache, evict the oldest lines to make room.
+ *      the cache takes a reference of its own, the caller still puts its one
+ *      TinyLFU admission: a line that needs room only gets in while it is
+ *      asked for more often than each victim, so a uri seen once cannot 
+ *      push out a popular one. A line kept out goes to the disk tier instead
+ */
+void writer(CACHE *line){
+    unsigned int hash = line->hash;
+    SHARD *sp = &shard[hash % NSHARD];
+    CACHE *old, *victims = NULL;
+    size_t bytes = line->bytes;
+    int freq = sketch_freq(hash), admit = 1;
+
+    if(bytes > shard_size)
+        return;
+    P(&sp->w);
+    /* another thread may have written it meanwhile */
+    if(lookup(sp, line->uri, hash) != NULL){
+        V(&sp->w);
+        return;
+    }
+    /* evict until the new line fits, or a victim is more popular */
+    while(sp->bytes + bytes > shard_size){
+        if(sketch_freq(clock_victim(sp)->hash) >= freq){
+            admit = 0;
+            break;
+        }
+        old = evict(sp);
+        sp->bytes -= old->bytes;
+        old->gone = victims;
+        victims = old;
+    }
+    if(!admit){
+        /* 
+         * the victims go back in their order in front of the hand,
+         *      as if it had only passed them; no reader saw them gone
+         */
+        while(victims != NULL){
+            old = victims;
+            victims = old->gone;
+            link_line(sp, old);
+            sp->hand = old;
+        }
+        V(&sp->w);
+        disk_put(line);
+        return;
+    }
+    
+    /* writing happens here */
+    line->ref = 0;
+    __atomic_fetch_add(&line->refcnt, 1, __ATOMIC_RELAXED);
+    link_line(sp, line);
+    /* end writing */
+    
+    V(&sp->w);
+    /* the evicted lines go to disk, out of the lock */
+    while(victims != NULL){
+        old = victims;
+        victims = old->gone;
+        disk_put(old);
+        retire_line(old);
+    }
+    if(__atomic_load_n(&retired, __ATOMIC_RELAXED) != NULL)
+        reclaim_lines();
+    return;
+}
+
+/*
+ * Add a line to its bucket, and to the ring right behind the hand, 
+ *      the last to be looked at. hold the writer lock of the shard
+ */
+void link_line(SHARD *sp, CACHE *line){
+    CACHE **head = &sp->bucket[(line->hash / NSHARD) % NBUCKET];
+
+    /* a lookup on a line put back follows it into this bucket */
+    __atomic_store_n(&line->next, *head, __ATOMIC_RELAXED);
+    __atomic_store_n(head, line, __ATOMIC_RELEASE);
+    sp->bytes += line->bytes;
+    if(sp->hand == NULL){
+        line->clock_prev = line->clock_next = line;
+        sp->hand = line;
+    }
+    else{
+        line->clock_next = sp->hand;
+        line->clock_prev = sp->hand->clock_prev;
+        line->clock_prev->clock_next = line;
+        sp->hand->clock_prev = line;
+    }
+}
+
+/*
+ * CLOCK: move the hand on, giving lines with the reference bit a second
+ *      chance, until it stops at a line without it, the next victim.
+ *      hold the writer lock of the shard, and there is at least one line
+ */
+CACHE *clock_victim(SHARD *sp){
+    while(__atomic_exchange_n(&sp->hand->ref, 0, __ATOMIC_RELAXED)){
+        sp->hand = sp->hand->clock_next;
+    }
+    return sp->hand;
+}
+
+/*
+ * Take the next victim out of the ring and its bucket
+ */
+CACHE *evict(SHARD *sp){
+    CACHE *line = clock_victim(sp), **pp;
+    if(line->clock_next == line){
+        sp->hand = NULL;
+    }
+    else{
+        line->clock_prev->clock_next = line->clock_next;
+        line->clock_next->clock_prev = line->clock_prev;
+        sp->hand = line->clock_next;
+    }
+    pp = &sp->bucket[(line->hash / NSHARD) % NBUCKET];
+    while(*pp != line){
+        pp = &(*pp)->next;
+    }
+    /* line->next stays, a lookup on the line goes on past it */
+    __atomic_store_n(pp, line->next, __ATOMIC_RELEASE);
+    return line;
+}
+
+/*
+ * Count an access to the uri of hash. Only the smallest counters grow
+ *      (conservative update), the others already count more than it.
+ *      the access that reaches SKETCH_SAMPLE halves every counter
+ */
+void sketch_add(unsigned int hash){
+    int freq = sketch_freq(hash);
+    unsigned char *cp;
+
+    if(freq < SKETCH_MAX){
+        for(int i = 0; i < SKETCH_DEPTH; i++){
+            cp = &sketch.count[i][sketch_index(hash, i)];
+            if(__atomic_load_n(cp, __ATOMIC_RELAXED) == freq)
+                __atomic_store_n(cp, freq + 1, __ATOMIC_RELAXED);
+        }
+    }
+    /* only one thread sees the count reach SKETCH_SAMPLE */
+    if(__atomic_add_fetch(&sketch.adds, 1, __ATOMIC_RELAXED) == SKETCH_SAMPLE){
+        for(int i = 0; i < SKETCH_DEPTH; i++){
+            for(int j = 0; j < (1 << SKETCH_BITS); j++){
+                cp = &sketch.count[i][j];
+                __atomic_store_n(cp, __atomic_load_n(cp, __ATOMIC_RELAXED) >> 1, 
+                        __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_sub_fetch(&sketch.adds, SKETCH_SAMPLE, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * How often the uri of hash was asked for lately, the smallest counter
+ */
+int sketch_freq(unsigned int hash){
+    int freq = SKETCH_MAX, n;
+    for(int i = 0; i < SKETCH_DEPTH; i++){
+        n = __atomic_load_n(&sketch.count[i][sketch_index(hash, i)], 
+                __ATOMIC_RELAXED);
+        freq = (n < freq) ? n : freq;
+    }
+    return freq;
+}
+
+/*
+ * The counter of hash in a row: mix it with an odd number of the row, 
+ *      take the high bits
+ */
+unsigned int sketch_index(unsigned int hash, int row){
+    static const unsigned int seed[SKETCH_DEPTH] = {
+        0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu
+    };
+    hash ^= hash >> 16;
+    return (hash * seed[row]) >> (32 - SKETCH_BITS);
+}
+
+/*
+ * Drop a reference, the last one frees the line
+ */
+void put_line(CACHE *line){
+    if(__atomic_sub_fetch(&line->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        free_line(line);
+}
+
+/*
+ * Free a line and give its chunks back
+ */
+void free_line(CACHE *line){
+    CHUNK *c;
+    while((c = line->head) != NULL){
+        line->head = c->next;
+        chunk_put(c);
+    }
+    if(line->uri != NULL)
+        Free(line->uri);
+    Free(line);
+}
+
+/*
+ * A chunk of CHUNK_SIZE bytes, from the pool if there is one
+ */
+CHUNK *chunk_get(){
+    CHUNK *c;
+
+    P(&chunk_mutex);
+    if((c = chunk_pool) != NULL){
+        chunk_pool = c->next;
+        chunk_nfree--;
+    }
+    V(&chunk_mutex);
+    if(c == NULL){
+        c = Malloc(sizeof(CHUNK) + CHUNK_SIZE);
+        c->cap = CHUNK_SIZE;
+    }
+    c->next = NULL;
+    return c;
+}
+
+/*
+ * Give a chunk back to the pool, free it if it is smaller or the pool full
+ */
+void chunk_put(CHUNK *c){
+    if(c->cap == CHUNK_SIZE){
+        P(&chunk_mutex);
+        if(chunk_nfree < POOL_CHUNKS){
+            c->next = chunk_pool;
+            chunk_pool = c;
+            chunk_nfree++;
+            c = NULL;
+        }
+        V(&chunk_mutex);
+    }
+    if(c != NULL)
+        Free(c);
+}
+
+/*
+ * Point iov at len bytes of the chunks, from the byte skip of c on,
+ *      at most CHUNK_IOV pieces of them. Return the number of pieces
+ */
+int chunk_iov(CHUNK *c, size_t skip, size_t len, struct iovec *iov){
+    int n = 0;
+    size_t k;
+
+    while(len > 0 && n < CHUNK_IOV){
+        if(skip == c->cap){
+            c = c->next;
+            skip = 0;
+        }
+        k = (c->cap - skip < len) ? c->cap - skip : len;
+        iov[n++] = (struct iovec){c->data + skip, k};
+        skip += k;
+        len -= k;
+    }
+    return n;
+}
+
+/*
+ * Move the chunk *cp and the byte *skipp in it past n bytes.
+ *      the next chunk is only looked at when there are bytes in it
+ */
+void chunk_skip(CHUNK **cp, size_t *skipp, size_t n){
+    size_t k;
+
+    while(n > 0){
+        if(*skipp == (*cp)->cap){
+            *cp = (*cp)->next;
+            *skipp = 0;
+        }
+        k = ((*cp)->cap - *skipp < n) ? (*cp)->cap - *skipp : n;
+        *skipp += k;
+        n -= k;
+    }
+}
+
+/*
+ * Send len bytes of the chunks to fd with writev, from the byte *skipp 
+ *      of *cp on, and move past them. Return the bytes sent, fewer if fd
+ *      is non-blocking and full, -1 if fd is gone
+ */
+ssize_t send_chunks(int fd, CHUNK **cp, size_t *skipp, size_t len){
+    struct iovec iov[CHUNK_IOV];
+    size_t sent = 0;
+    ssize_t n;
+
+    while(sent < len){
+        n = writev(fd, iov, chunk_iov(*cp, *skipp, len - sent, iov));
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && errno == EAGAIN)
+            break;
+        if(n <= 0)
+            return -1;
+        chunk_skip(cp, skipp, n);
+        sent += n;
+    }
+    return sent;
+}
+
+/*
+ * After a miss, join the flight of uri, or start one and be its leader.
+ *      the cache is looked at again under fmutex: a flight leaves flights 
+ *      only after its line is written, so a miss here is a real one;
+ *      returns NULL with a referenced line in *linep if it is a hit now
+ */
+FLIGHT *flight_join(char *uri, CACHE **linep, int *leader){
+    SHARD *sp = &shard[hash_uri(uri) % NSHARD];
+    FLIGHT *f;
+
+    P(&sp->fmutex);
+    if((*linep = cache_get(uri)) != NULL){
+        V(&sp->fmutex);
+        return NULL;
+    }
+    for(f = sp->flights; f != NULL; f = f->next){
+        if(!strcmp(f->uri, uri))
+            break;
+    }
+    if(f != NULL){
+        pthread_mutex_lock(&f->lock);
+        f->users++;
+        pthread_mutex_unlock(&f->lock);
+        *leader = 0;
+    }
+    else{
+        f = Malloc(sizeof(FLIGHT));
+        strcpy(f->uri, uri);
+        f->line = new_line();   /* its reference is held by the flight */
+        f->base = 0;
+        f->done = 0;
+        f->keep = 0;
+        f->users = 1;
+        f->open = 1;
+        f->followers = NULL;
+        pthread_mutex_init(&f->lock, NULL);
+        pthread_cond_init(&f->more, NULL);
+        pthread_cond_init(&f->sent, NULL);
+        f->next = sp->flights;
+        sp->flights = f;
+        *leader = 1;
+    }
+    V(&sp->fmutex);
+    return f;
+}
+
+/*
+ * Send the line of f to fd as it grows, until it is done.
+ *      chunks do not move, so the bytes in by now are sent without the lock
+ *      while the leader adds more after them;
+ *      return 1 if the response was sent whole and has its own length
+ */
+int flight_follow(FLIGHT *f, int fd){
+    CHUNK *c = NULL;
+    size_t size, skip = 0;
+    int keep;
+    FOLLOWER me, **pp;
+
+    pthread_mutex_lock(&f->lock);
+    me.off = 0;
+    me.next = f->followers;
+    f->followers = &me;
+    pthread_cond_signal(&f->sent);
+    while(1){
+        while(me.off == f->line->size && !f->done)
+            pthread_cond_wait(&f->more, &f->lock);
+        if(me.off == (size = f->line->size))
+            break;
+        if(c == NULL)
+            c = f->line->head;
+        pthread_mutex_unlock(&f->lock);
+        meter_sent(meter, size - me.off);
+        if(send_chunks(fd, &c, &skip, size - me.off) != (ssize_t)(size - me.off)){
+            pthread_mutex_lock(&f->lock);
+            break;
+        }
+        pthread_mutex_lock(&f->lock);
+        me.off = size;
+        pthread_cond_signal(&f->sent);
+    }
+    keep = f->done == 1 && f->keep && me.off == f->line->size;
+    for(pp = &f->followers; *pp != &me; pp = &(*pp)->next)
+        ;
+    *pp = me.next;
+    pthread_cond_signal(&f->sent);
+    pthread_mutex_unlock(&f->lock);
+    return keep;
+}
+
+/*
+ * Free the chunks of the line of f that every follower sent, 
+ *      *lowp is the least any of them sent. Hold f->lock.
+ *      A follower keeps the chunk it ended in, and the last one is kept
+ *      for the leader; a follower that did not start yet needs them all
+ */
+void flight_trim(FLIGHT *f, size_t *lowp){
+    FOLLOWER *fp;
+    CACHE *line = f->line;
+    CHUNK *c;
+    int n = 0;
+
+    *lowp = line->size;
+    for(fp = f->followers; fp != NULL; fp = fp->next){
+        *lowp = (fp->off < *lowp) ? fp->off : *lowp;
+        n++;
+    }
+    if(n < f->users - 1)
+        *lowp = 0;
+    while(line->head != line->tail && f->base + line->head->cap < *lowp){
+        c = line->head;
+        line->head = c->next;
+        f->base += c->cap;
+        chunk_put(c);
+    }
+}
+
+/*
+ * The leader is done with the server: wake the waiting threads,
+ *      and write a complete line small enough into the cache
+ */
+void flight_finish(FLIGHT *f, int done){
+    CACHE *line = NULL;
+
+    pthread_mutex_lock(&f->lock);
+    if(done == 1 && f->line != NULL && f->line->size <= max_object){
+        /* the others may be sending the last chunk, it stays as it is */
+        seal_line(f->line, f->uri, f->users == 1);
+        f->line->keep = f->keep;
+        line = f->line;
+    }
+    f->done = done;
+    pthread_cond_broadcast(&f->more);
+    pthread_mutex_unlock(&f->lock);
+    if(line != NULL)
+        writer(line);
+    flight_close(f);
+}
+
+/*
+ * Take f out of flights, later misses start a flight of their own
+ */
+void flight_close(FLIGHT *f){
+    SHARD *sp = &shard[hash_uri(f->uri) % NSHARD];
+    FLIGHT **pp;
+
+    P(&sp->fmutex);
+    if(f->open){
+        for(pp = &sp->flights; *pp != f; pp = &(*pp)->next)
+            ;
+        *pp = f->next;
+        f->open = 0;
+    }
+    V(&sp->fmutex);
+}
+
+/*
+ * Drop a user of f, the last one frees it, and puts its line
+ */
+void flight_leave(FLIGHT *f){
+    int users;
+
+    pthread_mutex_lock(&f->lock);
+    users = --f->users;
+    pthread_cond_signal(&f->sent);
+    pthread_mutex_unlock(&f->lock);
+    if(users > 0)
+        return;
+    if(f->line != NULL)
+        put_line(f->line);
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->more);
+    pthread_cond_destroy(&f->sent);
+    Free(f);
+}
+
+/*
+ * Find the origin of host and port, a new one if there is none.
+ *      hold origin_mutex, origins are never freed
+ */
+ORIGIN *find_origin(char *host, char *port){
+    char key[2 * MAXLINE];
+    ORIGIN *o, **head;
+
+    sprintf(key, "%s:%s", host, port);
+    head = &origin[hash_uri(key) % NORIGIN];
+    for(o = *head; o != NULL; o = o->next){
+        if(!strcmp(o->host, host) && !strcmp(o->port, port))
+            return o;
+    }
+    o = Malloc(sizeof(ORIGIN));
+    strcpy(o->host, host);
+    strcpy(o->port, port);
+    o->resolved = 0;
+    o->nidle = 0;
+    o->next = *head;
+    *head = o;
+    return o;
+}
+
+/*
+ * Like Open_clientfd, but take an idle connection to the origin first,
+ *      and connect to the address found last time, while it is fresh.
+ *      *reused is set for an idle connection, the server may have closed it
+ */
+int origin_connect(char *host, char *port, int *reused){
+    struct addrinfo hints, *listp, *p;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int fd, family, socktype, protocol, fresh;
+    char c;
+    ORIGIN *o;
+
+    P(&origin_mutex);
+    o = find_origin(host, port);
+    while(o->nidle > 0){
+        fd = o->idle[--o->nidle];
+        V(&origin_mutex);
+        /* nothing to read and not closed, it still works */
+        if(recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN){
+            *reused = 1;
+            return fd;
+        }
+        close(fd);
+        P(&origin_mutex);
+    }
+    fresh = o->resolved && time(NULL) - o->resolved < DNS_TTL;
+    addr = o->addr;
+    addrlen = o->addrlen;
+    family = o->family;
+    socktype = o->socktype;
+    protocol = o->protocol;
+    V(&origin_mutex);
+
+    *reused = 0;
+    if(fresh && (fd = socket(family, socktype, protocol)) >= 0){
+        if(connect(fd, (SA *)&addr, addrlen) == 0)
+            return fd;
+        close(fd);
+    }
+    /* resolve it again, from open_clientfd in csapp.c */
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if(getaddrinfo(host, port, &hints, &listp) != 0)
+        return -1;
+    for(p = listp; p; p = p->ai_next){
+        if((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        if(connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(fd);
+    }
+    if(p != NULL){
+        P(&origin_mutex);
+        memcpy(&o->addr, p->ai_addr, p->ai_addrlen);
+        o->addrlen = p->ai_addrlen;
+        o->family = p->ai_family;
+        o->socktype = p->ai_socktype;
+        o->protocol = p->ai_protocol;
+        o->resolved = time(NULL);
+        V(&origin_mutex);
+    }
+    freeaddrinfo(listp);
+    return p ? fd : -1;
+}
+
+/*
+ * A response is done and the server keeps the connection, 
+ *      keep it for the next request to the origin, or close it if enough are
+ */
+void origin_release(char *host, char *port, int fd){
+    ORIGIN *o;
+
+    P(&origin_mutex);
+    o = find_origin(host, port);
+    if(o->nidle < POOL_SIZE){
+        o->idle[o->nidle++] = fd;
+        fd = -1;
+    }
+    V(&origin_mutex);
+    if(fd >= 0)
+        close(fd);
+}
+
+/*
+ * Open the log in dir and build the index from it, record by record,
+ *      so the cache is warm after a restart.
+ *      A record cut short by a crash, and whatever follows it, is dropped.
+ */
+void disk_init(char *dir, size_t limit){
+    DISK_REC rec;
+    struct stat st;
+    char uri[MAXLINE];
+    off_t off = 0;
+    int fd;
+    pthread_t tid;
+
+    for(int i = 0; i < NDBUCKET; i++){
+        disk.bucket[i] = NULL;
+    }
+    disk.nent = 0;
+    disk.limit = limit;
+    disk.read_cnt = 0;
+    disk.front = disk.rear = disk.njob = 0;
+    sem_init(&disk.mutex, 0, 1);
+    sem_init(&disk.w, 0, 1);
+    sem_init(&disk.qmutex, 0, 1);
+    sem_init(&disk.items, 0, 0);
+    sprintf(disk.path, "%s/cache.log", dir);
+    if((fd = open(disk.path, O_RDWR | O_CREAT, 0644)) < 0)
+        unix_error("open cache log error");
+    fstat(fd, &st);
+    while(pread(fd, &rec, sizeof(rec), off) == sizeof(rec) && 
+            rec.magic == DISK_MAGIC && rec.uri_len < MAXLINE &&
+            off + DISK_BYTES(rec.size, rec.uri_len) <= (size_t)st.st_size &&
+            pread(fd, uri, rec.uri_len, off + sizeof(rec)) == rec.uri_len){
+        uri[rec.uri_len] = '\0';
+        disk_index(uri, &rec, off + sizeof(rec) + rec.uri_len);
+        off += DISK_BYTES(rec.size, rec.uri_len);
+    }
+    if(off < st.st_size && ftruncate(fd, off) < 0)
+        unix_error("ftruncate cache log error");
+    disk.end = off;
+    disk.log = Malloc(sizeof(LOGFILE));
+    disk.log->fd = fd;
+    disk.log->refcnt = 1;   /* held by disk */
+    Pthread_create(&tid, NULL, disk_worker, NULL);
+}
+
+/*
+ * Find the entry of uri, hold a lock of the index
+ */
+DISK_ENT *disk_find(char *uri, unsigned int hash){
+    DISK_ENT *e = disk.bucket[(hash / NSHARD) % NDBUCKET];
+    for(; e != NULL; e = e->next){
+        if(e->hash == hash && !strcmp(e->uri, uri))
+            return e;
+    }
+    return NULL;
+}
+
+/*
+ * The obj of a record is at off now, a later record of a uri wins.
+ *      hold the writer lock of the index
+ */
+void disk_index(char *uri, DISK_REC *rec, off_t off){
+    DISK_ENT *e, **head;
+
+    if((e = disk_find(uri, rec->hash)) == NULL){
+        e = Malloc(sizeof(DISK_ENT) + strlen(uri) + 1);
+        strcpy(e->uri, uri);
+        e->hash = rec->hash;
+        e->ref = 0;
+        head = &disk.bucket[(rec->hash / NSHARD) % NDBUCKET];
+        e->next = *head;
+        *head = e;
+        disk.nent++;
+    }
+    e->keep = rec->keep;
+    e->off = off;
+    e->size = rec->size;
+}
+
+/*
+ * Have a line evicted from memory appended to the log by the disk thread
+ */
+void disk_put(CACHE *line){
+    DISK_JOB job = {line, NULL, 0, 0, 0, NULL};
+
+    if(disk.log == NULL || 
+            DISK_BYTES(line->size, strlen(line->uri)) > disk.limit / 2)
+        return;
+    __atomic_fetch_add(&line->refcnt, 1, __ATOMIC_RELAXED);
+    if(!disk_submit(&job))
+        put_line(line);
+}
+
+/*
+ * Append a line to the log, unless it is there.
+ *      a full log is compacted first. Only the disk thread calls it
+ */
+void disk_append(CACHE *line){
+    DISK_REC rec;
+    struct iovec iov[CHUNK_IOV];
+    size_t bytes, skip = 0, left;
+    off_t off;
+    ssize_t n;
+    CHUNK *c = line->head;
+
+    rec.magic = DISK_MAGIC;
+    rec.hash = line->hash;
+    rec.uri_len = strlen(line->uri);
+    rec.keep = line->keep;
+    rec.size = line->size;
+    bytes = DISK_BYTES(rec.size, rec.uri_len);
+    iov[0] = (struct iovec){&rec, sizeof(rec)};
+    iov[1] = (struct iovec){line->uri, rec.uri_len};
+
+    if(disk_find(line->uri, line->hash) == NULL){
+        if(disk.end + bytes > disk.limit)
+            disk_compact();
+        /* the header and uri, then the chunks */
+        off = disk.end;
+        n = pwritev(disk.log->fd, iov, 2, off);
+        left = (n == (ssize_t)(sizeof(rec) + rec.uri_len)) ? rec.size : 0;
+        for(off += n; left > 0 && n > 0; off += n, left -= n){
+            n = pwritev(disk.log->fd, iov, chunk_iov(c, skip, left, iov), off);
+            if(n > 0)
+                chunk_skip(&c, &skip, n);
+        }
+        /* a record written in part is written over by the next one */
+        if(off == disk.end + (off_t)bytes){
+            P(&disk.w);
+            disk_index(line->uri, &rec, disk.end + sizeof(rec) + rec.uri_len);
+            V(&disk.w);
+            disk.end += bytes;
+        }
+    }
+}
+
+/*
+ * Find uri in the log, copy its entry into *ent with the reference bit
+ *      as it was, and set the bit. Return the log with a reference taken,
+ *      the obj is sent from it without any lock, NULL if it is not there
+ */
+LOGFILE *disk_get(char *uri, DISK_ENT *ent){
+    unsigned int hash;
+    DISK_ENT *e;
+    LOGFILE *log = NULL;
+
+    if(disk.log == NULL)
+        return NULL;
+    hash = hash_uri(uri);
+    P(&disk.mutex);
+    if(++disk.read_cnt == 1){
+        P(&disk.w);
+    }
+    V(&disk.mutex);
+
+    if((e = disk_find(uri, hash)) != NULL){
+        *ent = *e;
+        if(!ent->ref)
+            __atomic_store_n(&e->ref, 1, __ATOMIC_RELAXED);
+        log = disk.log;
+        __atomic_fetch_add(&log->refcnt, 1, __ATOMIC_RELAXED);
+    }
+
+    P(&disk.mutex);
+    if(--disk.read_cnt == 0){
+        V(&disk.w);
+    }
+    V(&disk.mutex);
+    return log;
+}
+
+/*
+ * Send the obj of uri from the log with sendfile if it is there.
+ *      *keep is set if it was sent whole and has its own length
+ */
+int disk_reader(int fd, char *uri, int *keep){
+    DISK_ENT ent;
+    LOGFILE *log;
+    off_t off;
+    size_t left;
+    ssize_t n = 0;
+
+    if((log = disk_get(uri, &ent)) == NULL)
+        return 0;
+    off = ent.off;
+    meter_sent(meter, ent.size);
+    for(left = ent.size; left > 0; left -= n){
+        if((n = sendfile(fd, log->fd, &off, left)) <= 0)
+            break;
+    }
+    *keep = left == 0 && ent.keep;
+    /* hit twice since the last compaction, back to memory */
+    if(ent.ref)
+        disk_promote(log, &ent, uri);
+    log_put(log);
+    return 1;
+}
+
+/*
+ * Have the obj of ent read back into a line of the cache in memory
+ */
+void disk_promote(LOGFILE *log, DISK_ENT *ent, char *uri){
+    DISK_JOB job = {NULL, log, ent->off, ent->size, ent->keep, NULL};
+
+    if(ent->size > max_object)
+        return;
+    __atomic_fetch_add(&log->refcnt, 1, __ATOMIC_RELAXED);
+    job.uri = Malloc(strlen(uri) + 1);
+    strcpy(job.uri, uri);
+    if(!disk_submit(&job)){
+        log_put(log);
+        Free(job.uri);
+    }
+}
+
+/*
+ * Add a job to the ring of the disk thread, return 0 if it is full:
+ *      the job is dropped, nothing waits for the disk
+ */
+int disk_submit(DISK_JOB *job){
+    P(&disk.qmutex);
+    if(disk.njob == DISK_QUEUE){
+        V(&disk.qmutex);
+        return 0;
+    }
+    disk.jobs[(++disk.rear) % DISK_QUEUE] = *job;
+    disk.njob++;
+    V(&disk.qmutex);
+    V(&disk.items);
+    return 1;
+}
+
+/*
+ * The disk thread: appends, compactions and reads of the log happen here,
+ *      so neither the eviction of a line nor the event loop waits for them
+ */
+void * disk_worker(void * vargp){
+    DISK_JOB job;
+
+    Pthread_detach(pthread_self());
+    while(1){
+        P(&disk.items);
+        P(&disk.qmutex);
+        job = disk.jobs[(++disk.front) % DISK_QUEUE];
+        disk.njob--;
+        V(&disk.qmutex);
+        if(job.line != NULL){
+            disk_append(job.line);
+            put_line(job.line);
+        }
+        else{
+            disk_load(&job);
+            log_put(job.log);
+            Free(job.uri);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Read the record of job back into a line, and write it into the cache
+ */
+void disk_load(DISK_JOB *job){
+    CACHE *line;
+    size_t size, room;
+    char *p;
+
+    line = new_line();
+    for(size = 0; size < job->size; size += room){
+        p = line_room(line, size, &room);
+        room = (room < job->size - size) ? room : job->size - size;
+        if(pread(job->log->fd, p, room, job->off + size) != (ssize_t)room){
+            free_line(line);
+            return;
+        }
+    }
+    line->size = job->size;
+    seal_line(line, job->uri, 1);
+    line->keep = job->keep;
+    writer(line);
+    put_line(line);
+}
+
+/*
+ * Copy the records worth keeping to a new log, and put it in place:
+ *      first those hit since the last compaction, then the newest,
+ *      up to half the limit. Hits go on from the old log meanwhile,
+ *      the index is only locked to move to the new one.
+ *      only the disk thread calls it
+ */
+void disk_compact(){
+    DISK_ENT **ents, *e, **pp;
+    DISK_REC rec;
+    LOGFILE *old = disk.log;
+    char tmp[MAXLINE + 4], *kept;
+    off_t *newoff, end = 0, from;
+    size_t bytes, total = 0;
+    ssize_t n = 0;
+    int fd, cnt = 0, ok = 1;
+
+    ents = Malloc((disk.nent + 1) * sizeof(DISK_ENT *));
+    for(int i = 0; i < NDBUCKET; i++){
+        for(e = disk.bucket[i]; e != NULL; e = e->next)
+            ents[cnt++] = e;
+    }
+    qsort(ents, cnt, sizeof(DISK_ENT *), cmp_newest);
+    kept = Calloc(cnt + 1, 1);
+    newoff = Malloc((cnt + 1) * sizeof(off_t));
+    for(int pass = 1; pass >= 0; pass--){
+        for(int i = 0; i < cnt; i++){
+            bytes = DISK_BYTES(ents[i]->size, strlen(ents[i]->uri));
+            if(!kept[i] && (pass == 0 || ents[i]->ref) && 
+                    total + bytes <= disk.limit / 2){
+                kept[i] = 1;
+                total += bytes;
+            }
+        }
+    }
+
+    /* oldest first, as they were */
+    sprintf(tmp, "%s.tmp", disk.path);
+    if((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+        ok = 0;
+    for(int i = cnt - 1; ok && i >= 0; i--){
+        if(!kept[i])
+            continue;
+        e = ents[i];
+        rec.magic = DISK_MAGIC;
+        rec.hash = e->hash;
+        rec.uri_len = strlen(e->uri);
+        rec.keep = e->keep;
+        rec.size = e->size;
+        if(rio_writen(fd, &rec, sizeof(rec)) != sizeof(rec) || 
+                rio_writen(fd, e->uri, rec.uri_len) != rec.uri_len){
+            ok = 0;
+            break;
+        }
+        newoff[i] = end + sizeof(rec) + rec.uri_len;
+        from = e->off;
+        for(bytes = e->size; bytes > 0; bytes -= n){
+            if((n = sendfile(fd, old->fd, &from, bytes)) <= 0){
+                ok = 0;
+                break;
+            }
+        }
+        end += DISK_BYTES(rec.size, rec.uri_len);
+    }
+    /* on disk before it takes the place of the old log */
+    if(!ok || fsync(fd) < 0 || rename(tmp, disk.path) < 0){
+        if(fd >= 0){
+            close(fd);
+            unlink(tmp);
+        }
+        Free(ents);
+        Free(kept);
+        Free(newoff);
+        return;
+    }
+
+    P(&disk.w);
+    for(int i = 0; i < cnt; i++){
+        e = ents[i];
+        if(kept[i]){
+            e->off = newoff[i];
+            e->ref = 0;
+            continue;
+        }
+        pp = &disk.bucket[(e->hash / NSHARD) % NDBUCKET];
+        while(*pp != e){
+            pp = &(*pp)->next;
+        }
+        *pp = e->next;
+        Free(e);
+        disk.nent--;
+    }
+    disk.log = Malloc(sizeof(LOGFILE));
+    disk.log->fd = fd;
+    disk.log->refcnt = 1;
+    disk.end = end;
+    V(&disk.w);
+    log_put(old);
+    Free(ents);
+    Free(kept);
+    Free(newoff);
+}
+
+/* For qsort, the entry latest in the log first */
+int cmp_newest(const void *a, const void *b){
+    const DISK_ENT *x = *(DISK_ENT * const *)a, *y = *(DISK_ENT * const *)b;
+    return (x->off < y->off) - (x->off > y->off);
+}
+
+/*
+ * Drop a reference, the last one closes the log
+ */
+void log_put(LOGFILE *log){
+    if(__atomic_sub_fetch(&log->refcnt, 1, __ATOMIC_ACQ_REL) == 0){
+        close(log->fd);
+        Free(log);
+    }
+}
+
+/*
+ * Microseconds from some fixed time
+ */
+unsigned long now_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Counters for the calling thread, joined to stats_list
+ */
+void stats_init(){
+    stats = Calloc(1, sizeof(STATS));
+    P(&stats_mutex);
+    stats->next = stats_list;
+    stats_list = stats;
+    V(&stats_mutex);
+}
+
+/*
+ * Add to a counter of this thread. It is the only writer, so a load and 
+ *      a store do, the store is atomic for the metrics page reading it
+ */
+void stat_add(unsigned long *p, unsigned long n){
+    __atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+}
+
+void hist_add(HIST *h, unsigned long us){
+    if(us >= (1UL << HIST_MAX_BITS))
+        us = (1UL << HIST_MAX_BITS) - 1;
+    stat_add(&h->count[hist_bucket(us)], 1);
+    stat_add(&h->n, 1);
+    stat_add(&h->sum, us);
+    if(us > h->max)
+        __atomic_store_n(&h->max, us, __ATOMIC_RELAXED);
+}
+
+/*
+ * Below 16 the bucket is the value, above it the power of 2 and 
+ *      the next HIST_SUB_BITS bits of the value
+ */
+int hist_bucket(unsigned long us){
+    int e;
+    if(us < (1UL << HIST_SUB_BITS))
+        return us;
+    e = 63 - __builtin_clzl(us);
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + 
+            ((us >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/*
+ * The largest value of bucket b
+ */
+unsigned long hist_value(int b){
+    int e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    unsigned long m = b & ((1 << HIST_SUB_BITS) - 1);
+    if(b < (1 << HIST_SUB_BITS))
+        return b;
+    return (((1UL << HIST_SUB_BITS) + m + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+/*
+ * The value q of the values are at most, within a bucket
+ */
+unsigned long hist_quantile(HIST *h, double q){
+    unsigned long want = (unsigned long)(q * h->n + 0.999999), seen = 0;
+    for(int b = 0; b < HIST_BUCKETS; b++){
+        seen += h->count[b];
+        if(seen >= want && seen > 0)
+            return hist_value(b) < h->max ? hist_value(b) : h->max;
+    }
+    return 0;
+}
+
+/*
+ * A request is in, start timing it
+ */
+void meter_start(METER *m){
+    m->start = now_us();
+    m->first = 0;
+    m->bytes = 0;
+    m->kind = M_FAIL;
+}
+
+/*
+ * n bytes of the response go out, the first of them ends the ttfb
+ */
+void meter_sent(METER *m, size_t n){
+    if(m == NULL)
+        return;
+    if(m->first == 0)
+        m->first = now_us();
+    m->bytes += n;
+}
+
+/*
+ * The request is done, count it in this thread's counters
+ */
+void meter_done(METER *m){
+    unsigned long end = now_us();
+    stat_add(&stats->requests[m->kind], 1);
+    stat_add(&stats->bytes[m->kind], m->bytes);
+    if(m->first != 0)
+        hist_add(&stats->ttfb, m->first - m->start);
+    hist_add(&stats->total, end - m->start);
+}
+
+/*
+ * Add up the counters of every thread into sum. They keep changing, 
+ *      so the sum is only close to a snapshot
+ */
+void stats_sum(STATS *sum){
+    HIST *from[3], *to[3] = {&sum->ttfb, &sum->total, &sum->connect};
+    STATS *s;
+
+    memset(sum, 0, sizeof(STATS));
+    P(&stats_mutex);
+    for(s = stats_list; s != NULL; s = s->next){
+        for(int k = 0; k < NKIND; k++){
+            sum->requests[k] += __atomic_load_n(&s->requests[k], __ATOMIC_RELAXED);
+            sum->bytes[k] += __atomic_load_n(&s->bytes[k], __ATOMIC_RELAXED);
+        }
+        from[0] = &s->ttfb;
+        from[1] = &s->total;
+        from[2] = &s->connect;
+        for(int i = 0; i < 3; i++){
+            for(int b = 0; b < HIST_BUCKETS; b++){
+                to[i]->count[b] += __atomic_load_n(&from[i]->count[b], 
+                        __ATOMIC_RELAXED);
+            }
+            to[i]->n += __atomic_load_n(&from[i]->n, __ATOMIC_RELAXED);
+            to[i]->sum += __atomic_load_n(&from[i]->sum, __ATOMIC_RELAXED);
+            if(__atomic_load_n(&from[i]->max, __ATOMIC_RELAXED) > to[i]->max)
+                to[i]->max = __atomic_load_n(&from[i]->max, __ATOMIC_RELAXED);
+        }
+    }
+    V(&stats_mutex);
+}
+
+/*
+ * The response to METRICS_PATH, in the text format of Prometheus.
+ *      return its length
+ */
+int metrics_page(char *buf, size_t size){
+    static const char *kind[NKIND] = {"hit", "disk", "wait", "miss", "fail"};
+    static const double q[4] = {0.5, 0.9, 0.99, 0.999};
+    STATS sum;
+    char body[MAXLINE];
+    HIST *h[3] = {&sum.ttfb, &sum.total, &sum.connect};
+    char *name[3] = {"ttfb", "total", "connect"};
+    unsigned long hits, reqs, hit_bytes, bytes;
+    int n = 0;
+
+    stats_sum(&sum);
+    for(int k = 0; k < NKIND; k++){
+        n += snprintf(body + n, MAXLINE - n, 
+                "proxy_requests_total{result=\"%s\"} %lu\n", kind[k], sum.requests[k]);
+    }
+    for(int k = 0; k < NKIND; k++){
+        n += snprintf(body + n, MAXLINE - n, 
+                "proxy_bytes_total{result=\"%s\"} %lu\n", kind[k], sum.bytes[k]);
+    }
+    /* the hits are the requests the servers never saw */
+    hits = sum.requests[M_HIT] + sum.requests[M_DISK] + sum.requests[M_WAIT];
+    reqs = hits + sum.requests[M_MISS];
+    hit_bytes = sum.bytes[M_HIT] + sum.bytes[M_DISK] + sum.bytes[M_WAIT];
+    bytes = hit_bytes + sum.bytes[M_MISS];
+    n += snprintf(body + n, MAXLINE - n, "proxy_hit_ratio %.4f\n", 
+            reqs ? (double)hits / reqs : 0.0);
+    n += snprintf(body + n, MAXLINE - n, "proxy_byte_hit_ratio %.4f\n", 
+            bytes ? (double)hit_bytes / bytes : 0.0);
+    for(int i = 0; i < 3; i++){
+        for(int j = 0; j < 4; j++){
+            n += snprintf(body + n, MAXLINE - n, 
+                    "proxy_%s_us{quantile=\"%g\"} %lu\n", name[i], q[j], 
+                    hist_quantile(h[i], q[j]));
+        }
+        n += snprintf(body + n, MAXLINE - n, "proxy_%s_us_max %lu\n"
+                "proxy_%s_us_sum %lu\nproxy_%s_us_count %lu\n", 
+                name[i], h[i]->max, name[i], h[i]->sum, name[i], h[i]->n);
+    }
+    return snprintf(buf, size, "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %d\r\n\r\n%s", n, body);
+}
+
+/*
+ * Add a line to the log ring, or drop it if the logger is behind.
+ *      only a copy under the lock, the logger does the writing
+ */
+void log_request(char *fmt, ...){
+    char line[MAXLINE];
+    va_list ap;
+    unsigned long n, at;
+
+    if(!logging)
+        return;
+    va_start(ap, fmt);
+    n = vsnprintf(line, MAXLINE, fmt, ap);
+    va_end(ap);
+    n = n < MAXLINE ? n : MAXLINE - 1;
+    P(&logring.mutex);
+    if(logring.head - logring.tail + n > LOG_RING){
+        logring.dropped++;
+        V(&logring.mutex);
+        return;
+    }
+    for(unsigned long i = 0; i < n; i++){
+        at = (logring.head + i) % LOG_RING;
+        logring.buf[at] = line[i];
+    }
+    logring.head += n;
+    V(&logring.mutex);
+    V(&logring.lines);
+}
+
+/*
+ * Write the log ring to stdout, as much as is there at a time
+ */
+void * logger(void * vargp){
+    static char buf[LOG_RING];
+    unsigned long n, dropped;
+    char note[MAXLINE];
+
+    Pthread_detach(pthread_self());
+    while(1){
+        P(&logring.lines);
+        P(&logring.mutex);
+        n = logring.head - logring.tail;
+        for(unsigned long i = 0; i < n; i++){
+            buf[i] = logring.buf[(logring.tail + i) % LOG_RING];
+        }
+        logring.tail = logring.head;
+        dropped = logring.dropped;
+        logring.dropped = 0;
+        V(&logring.mutex);
+        /* the lines counted by lines were written together */
+        if(n > 0 && rio_writen(STDOUT_FILENO, buf, n) < 0)
+            continue;
+        if(dropped > 0){
+            n = snprintf(note, MAXLINE, "%lu log lines dropped\n", dropped);
+            rio_writen(STDOUT_FILENO, note, n);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Event loop, started with -e, one per core.
+ *      every loop has its own listening socket on the same port with 
+ *      SO_REUSEPORT, the kernel spreads the connections among them;
+ *      sockets are non-blocking, each connection moves through ST_*
+ */
+void * event_loop(void * vargp){
+    int listenfd, epfd, n;
+    struct epoll_event ev, events[MAX_EVENTS];
+    CONN *closed, *c;
+
+    stats_init();
+    if((listenfd = open_reuseport_listenfd((char *)vargp)) < 0)
+        unix_error("open_reuseport_listenfd error");
+    if((epfd = epoll_create1(0)) < 0)
+        unix_error("epoll_create1 error");
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;     /* NULL is the listening socket */
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
+    while(1){
+        if((n = epoll_wait(epfd, events, MAX_EVENTS, -1)) < 0)
+            continue;
+        closed = NULL;
+        for(int i = 0; i < n; i++){
+            END *ep = events[i].data.ptr;
+            if(ep == NULL){
+                accept_conns(epfd, listenfd);
+                continue;
+            }
+            c = ep->conn;
+            /* closed by an earlier event of this round */
+            if(c->state == ST_CLOSED)
+                continue;
+            if(ep == &c->client)
+                client_event(epfd, c, events[i].events);
+            else
+                server_event(epfd, c, events[i].events);
+            if(c->state == ST_CLOSED){
+                c->next_closed = closed;
+                closed = c;
+            }
+        }
+        /* events of this round may still point to them until here */
+        while(closed != NULL){
+            c = closed;
+            closed = c->next_closed;
+            Free(c);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * open_listenfd from csapp.c, but non-blocking and with SO_REUSEPORT
+ */
+int open_reuseport_listenfd(char *port){
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if(getaddrinfo(NULL, port, &hints, &listp) != 0)
+        return -1;
+    for(p = listp; p; p = p->ai_next){
+        if((listenfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, 
+                p->ai_protocol)) < 0)
+            continue;
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+        if(bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(listenfd);
+    }
+    freeaddrinfo(listp);
+    if(!p || listen(listenfd, LISTENQ) < 0)
+        return -1;
+    return listenfd;
+}
+
+/*
+ * open_clientfd from csapp.c, but the connect is only started,
+ *      the socket is writable once it is done
+ */
+int open_nonblock_clientfd(char *hostname, char *port){
+    struct addrinfo hints, *listp, *p;
+    int clientfd = -1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if(getaddrinfo(hostname, port, &hints, &listp) != 0)
+        return -1;
+    for(p = listp; p; p = p->ai_next){
+        if((clientfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, 
+                p->ai_protocol)) < 0)
+            continue;
+        if(connect(clientfd, p->ai_addr, p->ai_addrlen) == 0 || 
+                errno == EINPROGRESS)
+            break;
+        close(clientfd);
+    }
+    freeaddrinfo(listp);
+    return p ? clientfd : -1;
+}
+
+/*
+ * Add or change the events of one socket
+ */
+void set_events(int epfd, END *ep, int op, unsigned int events){
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = ep;
+    epoll_ctl(epfd, op, ep->fd, &ev);
+}
+
+/*
+ * Take every pending connection, and wait for its request
+ */
+void accept_conns(int epfd, int listenfd){
+    int connfd, one = 1;
+    CONN *c;
+    while((connfd = accept(listenfd, NULL, NULL)) >= 0){
+        fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c = Malloc(sizeof(CONN));
+        c->client.conn = c->server.conn = c;
+        c->client.fd = connfd;
+        c->server.fd = -1;
+        c->state = ST_REQUEST;
+        c->eof = 0;
+        request_init(&c->rq);
+        c->out_len = c->out_off = 0;
+        c->fill = NULL;
+        c->line = NULL;
+        c->log = NULL;
+        c->m.start = c->connect_start = 0;
+        set_events(epfd, &c->client, EPOLL_CTL_ADD, EPOLLIN);
+    }
+}
+
+/*
+ * The client sent more of the request, or can take more of the response
+ */
+void client_event(int epfd, CONN *c, unsigned int events){
+    ssize_t n;
+    int rc;
+    if(c->state == ST_REQUEST && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))){
+        n = read(c->client.fd, c->rq.buf + c->rq.len, MAXLINE - c->rq.len);
+        if(n < 0 && errno == EAGAIN)
+            return;
+        if(n <= 0){
+            close_conn(c);
+            return;
+        }
+        c->rq.len += n;
+        /* only the new lines are parsed */
+        if((rc = parse_request(&c->rq)) > 0)
+            start_request(epfd, c);
+        else if(rc < 0 || c->rq.len == MAXLINE)    /* bad or too long */
+            close_conn(c);
+    }
+    else if(events & EPOLLOUT){
+        flush_client(epfd, c);
+    }
+    else if(events & (EPOLLERR | EPOLLHUP)){
+        close_conn(c);
+    }
+}
+
+/*
+ * The whole request is in, like doit: answer from the cache, 
+ *      or rewrite it and start connecting to the server
+ */
+void start_request(int epfd, CONN *c){
+    Request_Line line;
+    DISK_ENT ent;
+    int n;
+
+    c->uri = request_key(&c->rq, c->key);
+    if(strcasecmp(c->rq.buf + c->rq.method.off, "GET")){
+        log_request("Not implemented\n");
+        close_conn(c);
+        return;
+    }
+    /* a new socket has room for the whole page, one write sends it */
+    if(!strcmp(c->rq.buf + c->rq.uri.off, METRICS_PATH)){
+        n = metrics_page(c->out, MAXLINE);
+        rio_writen(c->client.fd, c->out, n);
+        close_conn(c);
+        return;
+    }
+    meter_start(&c->m);
+    /* stop reading from the client, it is all here */
+    set_events(epfd, &c->client, EPOLL_CTL_MOD, 0);
+    sketch_add(hash_uri(c->uri));
+    /* hit and send */
+    if((c->line = cache_get(c->uri)) != NULL){
+        log_request("%s from cache hit\n", c->uri);
+        c->m.kind = M_HIT;
+        c->state = ST_CACHED;
+        c->out_off = 0;
+        c->chunk = c->line->head;
+        c->chunk_skip = 0;
+        flush_client(epfd, c);
+        return;
+    }
+    if((c->log = disk_get(c->uri, &ent)) != NULL){
+        log_request("%s from disk hit\n", c->uri);
+        c->m.kind = M_DISK;
+        if(ent.ref)
+            disk_promote(c->log, &ent, c->uri);
+        c->state = ST_DISK;
+        c->disk_off = ent.off;
+        c->disk_left = ent.size;
+        flush_client(epfd, c);
+        return;
+    }
+    log_request("%s miss\n", c->uri);
+
+    if(parse_uri(&c->rq, &line)){
+        log_request("Bad uri\n");
+        close_conn(c);
+        return;
+    }
+    /* the iovecs point into rq and to constants, not into line */
+    c->iovcnt = make_request(&c->rq, &line, c->iov, 0);
+    c->iov_first = 0;
+
+    if((c->server.fd = open_nonblock_clientfd(line.host, line.port)) < 0){
+        log_request("Connection failed\n");
+        close_conn(c);
+        return;
+    }
+    c->connect_start = now_us();
+    c->m.kind = M_MISS;
+    c->state = ST_CONNECT;
+    c->fill = new_line();
+    set_events(epfd, &c->server, EPOLL_CTL_ADD, EPOLLOUT);
+}
+
+/*
+ * The server is connected and can take the request, or sent some response
+ */
+void server_event(int epfd, CONN *c, unsigned int events){
+    ssize_t n;
+    size_t room;
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if(c->state == ST_CONNECT){
+        getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if(err || (events & EPOLLERR)){
+            log_request("Connection failed\n");
+            c->m.kind = M_FAIL;
+            close_conn(c);
+            return;
+        }
+        if(c->connect_start != 0){
+            hist_add(&stats->connect, now_us() - c->connect_start);
+            c->connect_start = 0;
+        }
+        while(c->iov_first < c->iovcnt){
+            n = writev(c->server.fd, c->iov + c->iov_first, 
+                    c->iovcnt - c->iov_first);
+            if(n < 0 && errno == EAGAIN)
+                return;
+            if(n <= 0){
+                close_conn(c);
+                return;
+            }
+            iov_skip(c->iov, &c->iov_first, n);
+        }
+        c->state = ST_RELAY;
+        c->out_len = c->out_off = 0;
+        set_events(epfd, &c->server, EPOLL_CTL_MOD, EPOLLIN);
+        return;
+    }
+    /* ST_RELAY, and nothing is pending: the server is only read then */
+    /* while it may still be cached, read straight into the line */
+    if(c->fill != NULL && c->fill->size < max_object){
+        c->data = line_room(c->fill, c->fill->size, &room);
+        if(room > max_object - c->fill->size)
+            room = max_object - c->fill->size;
+        n = read(c->server.fd, c->data, room);
+    }
+    else{
+        c->data = c->out;
+        n = read(c->server.fd, c->data, MAXLINE);
+    }
+    if(n < 0 && errno == EAGAIN)
+        return;
+    if(n <= 0){
+        c->eof = 1;
+        /* write to cache if possible, only a complete response */
+        if(n == 0 && c->fill != NULL){
+            seal_line(c->fill, c->uri, 1);
+            writer(c->fill);
+            put_line(c->fill);
+            c->fill = NULL;
+        }
+        close_conn(c);
+        return;
+    }
+    if(c->data == c->out && c->fill != NULL){  /* too large */
+        free_line(c->fill);
+        c->fill = NULL;
+    }
+    if(c->fill != NULL)
+        c->fill->size += n;
+    c->out_len = n;
+    c->out_off = 0;
+    /* do not read more until this is sent */
+    set_events(epfd, &c->server, EPOLL_CTL_MOD, 0);
+    flush_client(epfd, c);
+}
+
+/*
+ * Send what is pending to the client, wait for EPOLLOUT if it is full
+ */
+void flush_client(int epfd, CONN *c){
+    ssize_t n;
+
+    /* a line, chunk by chunk with writev */
+    if(c->state == ST_CACHED){
+        n = send_chunks(c->client.fd, &c->chunk, &c->chunk_skip, 
+                c->line->size - c->out_off);
+        if(n < 0){
+            close_conn(c);
+            return;
+        }
+        if(n > 0)
+            meter_sent(&c->m, n);
+        c->out_off += n;
+        if(c->out_off < c->line->size)
+            set_events(epfd, &c->client, EPOLL_CTL_MOD, EPOLLOUT);
+        else
+            close_conn(c);
+        return;
+    }
+
+    /* from the log to the client, with sendfile */
+    while(c->state == ST_DISK && c->disk_left > 0){
+        n = sendfile(c->client.fd, c->log->fd, &c->disk_off, c->disk_left);
+        if(n < 0 && errno == EAGAIN){
+            set_events(epfd, &c->client, EPOLL_CTL_MOD, EPOLLOUT);
+            return;
+        }
+        if(n <= 0){
+            close_conn(c);
+            return;
+        }
+        meter_sent(&c->m, n);
+        c->disk_left -= n;
+    }
+    if(c->state == ST_DISK){
+        close_conn(c);
+        return;
+    }
+
+    while(c->out_off < c->out_len){
+        n = write(c->client.fd, c->data + c->out_off, c->out_len - c->out_off);
+        if(n < 0 && errno == EAGAIN){
+            set_events(epfd, &c->client, EPOLL_CTL_MOD, EPOLLOUT);
+            return;
+        }
+        if(n <= 0){
+            close_conn(c);
+            return;
+        }
+        meter_sent(&c->m, n);
+        c->out_off += n;
+    }
+    /* all sent, read more from the server */
+    set_events(epfd, &c->client, EPOLL_CTL_MOD, 0);
+    set_events(epfd, &c->server, EPOLL_CTL_MOD, EPOLLIN);
+}
+
+/*
+ * Close both sockets, the CONN is freed by the event loop
+ */
+void close_conn(CONN *c){
+    Close(c->client.fd);
+    if(c->server.fd >= 0)
+        Close(c->server.fd);
+    if(c->line != NULL)
+        put_line(c->line);
+    if(c->log != NULL)
+        log_put(c->log);
+    if(c->fill != NULL)
+        free_line(c->fill);
+    if(c->m.start != 0)
+        meter_done(&c->m);
+    c->state = ST_CLOSED;
+}
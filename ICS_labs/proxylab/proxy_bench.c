@@ -0,0 +1,514 @@
+/*
+ * proxy_bench - load generator for proxy.c, with a stub origin server
+ *
+ * Build it on its own, it needs nothing from the lab:
+ *      gcc -Wall -O2 -o proxy_bench proxy_bench.c -lpthread -lm
+ * Start the proxy, then drive it through loopback:
+ *      ./proxy 18081 &
+ *      ./proxy_bench [-c conns] [-t secs] [-w secs] [-r rate] [-k keys]
+ *              [-a alpha] [-s sizes] [-o port] [-T secs] 18081
+ * or only run the origin, to try the proxy by hand:
+ *      ./proxy_bench -S [-o port]
+ *
+ * The origin runs in the same process on 127.0.0.1, port -o (18099).
+ *      It serves /obj/<key>/<size> with Content-Length and keep-alive,
+ *      the body a pattern of the key, so every response is checked.
+ * Keys are drawn from -k keys with Zipf skew -a (0 is uniform).
+ *      The size of a key is fixed, from -s:
+ *      fixed:N, uniform:MIN:MAX or log:MIN:MAX (log-uniform, many small
+ *      objects and a few large ones, as on the web).
+ * Closed loop by default: -c connections, each sends its next request
+ *      when the last one is answered. With -r, open loop: each connection
+ *      sends at rate/conns, and latency counts from when the request
+ *      was due, so a proxy falling behind shows in it.
+ *
+ * Reports requests/sec, latency p50/p99/p999, and the hit ratio, which is
+ *      the requests and bytes that never reached the origin.
+ *      The first -w seconds are a warmup and are not counted.
+ * A request still out at the end is waited for and counted with its
+ *      latency; one with no answer for -T secs (10) is a timeout, so a
+ *      stalled connection shows in the report instead of vanishing.
+ *      The completions of each connection are reported too, min and max,
+ *      as a proxy that starves some connections can still look fast.
+ */
+#define _GNU_SOURCE     /* for strcasestr */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define MAXLINE 8192
+#define PATTERN 251     /* bodies are i % PATTERN, from an offset of the key */
+#define TIMEDOUT -2     /* fetch got no answer in time */
+
+/* Sizes of objects */
+#define SIZE_FIXED 0
+#define SIZE_UNIFORM 1
+#define SIZE_LOG 2
+
+/* One connection of the load, and what it saw */
+typedef struct{
+    pthread_t tid;
+    unsigned long rng;
+    long *lat;      /* latencies in microseconds */
+    long nlat, cap;
+    long errors, timeouts;
+    unsigned long bytes;
+}CLIENT;
+
+static int origin_port = 18099, proxy_port;
+static int nconns = 16, secs = 10, warmup = 1, timeout = 10;
+static double rate = 0, alpha = 0.8;
+static long nkeys = 10000;
+static int size_kind = SIZE_LOG;
+static long size_min = 100, size_max = 200000;
+
+static double *zipf_cdf;    /* of key ranks */
+static char *pattern;       /* size_max + PATTERN bytes of i % PATTERN */
+static volatile int counting, stop;
+static unsigned long origin_reqs, origin_bytes;     /* while counting */
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* splitmix64, for the sizes of keys and the random numbers of clients */
+static unsigned long mix(unsigned long x){
+    x += 0x9e3779b97f4a7c15UL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9UL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebUL;
+    return x ^ (x >> 31);
+}
+
+/* Uniform in [0, 1) */
+static double uniform(unsigned long *rng){
+    *rng = mix(*rng);
+    return (*rng >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* The size of a key, the same in every run */
+static long key_size(long key){
+    double u = (mix(key) >> 11) * (1.0 / 9007199254740992.0);
+    switch(size_kind){
+        case SIZE_FIXED: return size_min;
+        case SIZE_UNIFORM: return size_min + (long)(u * (size_max - size_min + 1));
+        default: return (long)(size_min * pow((double)size_max / size_min, u));
+    }
+}
+
+/* Key of rank i is taken with weight 1 / (i + 1)^alpha */
+static void zipf_init(void){
+    double sum = 0;
+    zipf_cdf = malloc(nkeys * sizeof(double));
+    for(long i = 0; i < nkeys; i++){
+        sum += 1.0 / pow(i + 1, alpha);
+        zipf_cdf[i] = sum;
+    }
+    for(long i = 0; i < nkeys; i++){
+        zipf_cdf[i] /= sum;
+    }
+}
+
+static long zipf_key(unsigned long *rng){
+    double u = uniform(rng);
+    long lo = 0, hi = nkeys - 1, mid;
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(zipf_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int write_all(int fd, const char *buf, size_t n){
+    ssize_t k;
+    while(n > 0){
+        if((k = write(fd, buf, n)) < 0 && errno == EINTR)
+            continue;
+        if(k <= 0)
+            return -1;
+        buf += k;
+        n -= k;
+    }
+    return 0;
+}
+
+/* Both pieces, header and body */
+static int writev_all(int fd, struct iovec *iov){
+    ssize_t k;
+    int i = 0;
+    while(i < 2){
+        if((k = writev(fd, iov + i, 2 - i)) < 0 && errno == EINTR)
+            continue;
+        if(k <= 0)
+            return -1;
+        for(; i < 2 && (size_t)k >= iov[i].iov_len; i++){
+            k -= iov[i].iov_len;
+        }
+        if(i < 2){
+            iov[i].iov_base = (char *)iov[i].iov_base + k;
+            iov[i].iov_len -= k;
+        }
+    }
+    return 0;
+}
+
+static int listen_on(int port){
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1024) < 0){
+        perror("origin");
+        exit(1);
+    }
+    return fd;
+}
+
+static int connect_to(int port){
+    struct sockaddr_in addr;
+    struct timeval tv = {timeout, 0};
+    int fd = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    /* reads and writes fail with EAGAIN after -T secs without progress */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Read up to the end of the headers into buf, MAXLINE bytes.
+ *      return the bytes read, which may go past the headers, with *endp
+ *      at the body; 0 if the peer closed first, -1 on an error
+ */
+static ssize_t read_head(int fd, char *buf, char **endp){
+    ssize_t n, k = 0;
+    char *end;
+    while(1){
+        if((n = read(fd, buf + k, MAXLINE - 1 - k)) < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return k == 0 ? n : -1;
+        k += n;
+        buf[k] = '\0';
+        if((end = strstr(buf, "\r\n\r\n")) != NULL){
+            *endp = end + 4;
+            return k;
+        }
+        if(k == MAXLINE - 1)
+            return -1;
+    }
+}
+
+/*
+ * One connection to the origin, request after request
+ */
+static void *origin_conn(void *vargp){
+    int fd = (int)(long)vargp, keep;
+    char buf[MAXLINE], head[256], *end;
+    const char *not_found = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    long key, size;
+    ssize_t n;
+    struct iovec iov[2];
+
+    pthread_detach(pthread_self());
+    while((n = read_head(fd, buf, &end)) > 0){
+        keep = strstr(buf, "HTTP/1.1\r\n") != NULL &&
+                strcasestr(buf, "Connection: close") == NULL;
+        if(sscanf(buf, "GET /obj/%ld/%ld", &key, &size) != 2 || size < 0 ||
+                size > size_max){
+            if(write_all(fd, not_found, strlen(not_found)) < 0)
+                break;
+            continue;
+        }
+        if(counting){
+            __atomic_fetch_add(&origin_reqs, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&origin_bytes, size, __ATOMIC_RELAXED);
+        }
+        n = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n"
+                "Content-Type: application/octet-stream\r\n"
+                "Content-Length: %ld\r\n%s\r\n", size, keep ? "" : "Connection: close\r\n");
+        /* one writev, a small write before the body would wait for an ack */
+        iov[0] = (struct iovec){head, n};
+        iov[1] = (struct iovec){pattern + key % PATTERN, size};
+        if(writev_all(fd, iov) < 0 || !keep)
+            break;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void *origin(void *vargp){
+    int listenfd = (int)(long)vargp, fd;
+    pthread_t tid;
+    while(1){
+        if((fd = accept(listenfd, NULL, NULL)) < 0)
+            continue;
+        pthread_create(&tid, NULL, origin_conn, (void *)(long)fd);
+    }
+    return NULL;
+}
+
+/*
+ * Ask the proxy for a key on *fdp, connecting first if it is -1.
+ *      return 0 if the whole body came back right, TIMEDOUT if the proxy
+ *      stopped answering for -T secs, -1 otherwise;
+ *      *fdp is -1 again once the connection cannot be used any more
+ */
+static int fetch(CLIENT *c, int *fdp, long key){
+    char buf[MAXLINE], *body, *p;
+    long size = key_size(key), len = -1, got, want;
+    int n, status = 0, retry, keep;
+    ssize_t k;
+
+    n = snprintf(buf, MAXLINE, "GET http://127.0.0.1:%d/obj/%ld/%ld HTTP/1.1\r\n"
+            "Host: 127.0.0.1:%d\r\n\r\n", origin_port, key, size, origin_port);
+    /* a kept connection the proxy closed meanwhile is tried once more */
+    for(retry = (*fdp >= 0); ; retry = 0){
+        if(*fdp < 0 && (*fdp = connect_to(proxy_port)) < 0)
+            return -1;
+        errno = 0;
+        if(write_all(*fdp, buf, n) == 0 && (k = read_head(*fdp, buf, &body)) > 0)
+            break;
+        close(*fdp);
+        *fdp = -1;
+        /* a slow answer is not a closed connection, asking again would hide it */
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+            return TIMEDOUT;
+        if(!retry)
+            return -1;
+        n = snprintf(buf, MAXLINE, "GET http://127.0.0.1:%d/obj/%ld/%ld HTTP/1.1\r\n"
+                "Host: 127.0.0.1:%d\r\n\r\n", origin_port, key, size, origin_port);
+    }
+    sscanf(buf, "HTTP/1.%*d %d", &status);
+    if((p = strcasestr(buf, "\r\nContent-Length:")) != NULL)
+        len = atol(p + 17);
+    keep = strstr(buf, "HTTP/1.1") == buf && strcasestr(buf, "Connection: close") == NULL;
+    if(status != 200 || len != size){
+        close(*fdp);
+        *fdp = -1;
+        return -1;
+    }
+    /* the body, checked against the pattern of the key as it comes */
+    p = pattern + key % PATTERN;
+    got = k - (body - buf);
+    if(got > len || memcmp(body, p, got)){
+        close(*fdp);
+        *fdp = -1;
+        return -1;
+    }
+    while(got < len){
+        want = len - got < MAXLINE ? len - got : MAXLINE;
+        if((k = read(*fdp, buf, want)) < 0 && errno == EINTR)
+            continue;
+        if(k <= 0 || memcmp(buf, p + got, k)){
+            n = k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            close(*fdp);
+            *fdp = -1;
+            return n ? TIMEDOUT : -1;
+        }
+        got += k;
+    }
+    if(counting)
+        c->bytes += len;
+    if(!keep){
+        close(*fdp);
+        *fdp = -1;
+    }
+    return 0;
+}
+
+static void *client(void *vargp){
+    CLIENT *c = vargp;
+    int fd = -1, rc;
+    double due = now(), start, wait, gap = rate > 0 ? nconns / rate : 0;
+
+    /* open loop: exponential gaps, a Poisson stream of rate/nconns */
+    if(gap > 0)
+        due += gap * uniform(&c->rng);
+    while(!stop){
+        if(gap > 0){
+            if((wait = due - now()) > 0)
+                usleep(wait * 1e6);
+            start = due;
+            due += -gap * log(1 - uniform(&c->rng));
+        }
+        else
+            start = now();
+        /* one out when stop comes is finished and counted, not dropped */
+        rc = fetch(c, &fd, zipf_key(&c->rng));
+        if(!counting)
+            continue;
+        if(rc == TIMEDOUT){
+            c->timeouts++;
+            continue;
+        }
+        if(rc < 0){
+            c->errors++;
+            continue;
+        }
+        if(c->nlat == c->cap){
+            c->cap = c->cap ? 2 * c->cap : 1 << 16;
+            c->lat = realloc(c->lat, c->cap * sizeof(long));
+        }
+        c->lat[c->nlat++] = (long)((now() - start) * 1e6);
+    }
+    if(fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+static int cmp_long(const void *a, const void *b){
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+/* Latency below which a fraction q of the requests were */
+static long quantile(long *lat, long n, double q){
+    long i = (long)ceil(q * n) - 1;
+    return n == 0 ? 0 : lat[i < 0 ? 0 : i];
+}
+
+static int parse_sizes(char *s){
+    if(sscanf(s, "fixed:%ld", &size_min) == 1){
+        size_kind = SIZE_FIXED;
+        size_max = size_min;
+        return size_min >= 0;
+    }
+    if(sscanf(s, "uniform:%ld:%ld", &size_min, &size_max) == 2)
+        size_kind = SIZE_UNIFORM;
+    else if(sscanf(s, "log:%ld:%ld", &size_min, &size_max) == 2)
+        size_kind = SIZE_LOG;
+    else
+        return 0;
+    return size_min > 0 && size_max >= size_min;
+}
+
+static void usage(char *prog){
+    fprintf(stderr, "usage: %s [-c conns] [-t secs] [-w secs] [-r rate] [-k keys] "
+            "[-a alpha] [-s sizes] [-o port] [-T secs] <proxy port>\n"
+            "       %s -S [-o port] [-s sizes]\n"
+            "    sizes: fixed:N, uniform:MIN:MAX or log:MIN:MAX\n", prog, prog);
+    exit(1);
+}
+
+int main(int argc, char **argv){
+    int opt, only_origin = 0;
+    pthread_t tid;
+    CLIENT *clients;
+    long n = 0, errors = 0, timeouts = 0, *lat, least = -1, most = 0;
+    int starved = 0;
+    unsigned long bytes = 0, sum = 0;
+    double start, elapsed;
+
+    while((opt = getopt(argc, argv, "Sc:t:w:r:k:a:s:o:T:")) != -1){
+        switch(opt){
+            case 'S': only_origin = 1; break;
+            case 'c': nconns = atoi(optarg); break;
+            case 't': secs = atoi(optarg); break;
+            case 'w': warmup = atoi(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'k': nkeys = atol(optarg); break;
+            case 'a': alpha = atof(optarg); break;
+            case 's': if(!parse_sizes(optarg)) usage(argv[0]); break;
+            case 'o': origin_port = atoi(optarg); break;
+            case 'T': timeout = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if((!only_origin && optind != argc - 1) || nconns <= 0 || secs <= 0 ||
+            warmup < 0 || rate < 0 || nkeys <= 0 || alpha < 0 || timeout <= 0)
+        usage(argv[0]);
+    signal(SIGPIPE, SIG_IGN);
+    pattern = malloc(size_max + PATTERN);
+    for(long i = 0; i < size_max + PATTERN; i++){
+        pattern[i] = i % PATTERN;
+    }
+    pthread_create(&tid, NULL, origin, (void *)(long)listen_on(origin_port));
+    if(only_origin){
+        printf("origin on 127.0.0.1:%d\n", origin_port);
+        pause();
+    }
+    proxy_port = atoi(argv[optind]);
+
+    zipf_init();
+    clients = calloc(nconns, sizeof(CLIENT));
+    for(int i = 0; i < nconns; i++){
+        clients[i].rng = mix(i + 1);
+        pthread_create(&clients[i].tid, NULL, client, &clients[i]);
+    }
+    sleep(warmup);
+    counting = 1;
+    start = now();
+    sleep(secs);
+    stop = 1;
+    elapsed = now() - start;
+    /* each joins once its last request is answered or times out */
+    for(int i = 0; i < nconns; i++){
+        pthread_join(clients[i].tid, NULL);
+        n += clients[i].nlat;
+        errors += clients[i].errors;
+        timeouts += clients[i].timeouts;
+        bytes += clients[i].bytes;
+        if(least < 0 || clients[i].nlat < least)
+            least = clients[i].nlat;
+        if(clients[i].nlat > most)
+            most = clients[i].nlat;
+        if(clients[i].nlat == 0)
+            starved++;
+    }
+    lat = malloc((n + 1) * sizeof(long));
+    n = 0;
+    for(int i = 0; i < nconns; i++){
+        memcpy(lat + n, clients[i].lat, clients[i].nlat * sizeof(long));
+        n += clients[i].nlat;
+    }
+    qsort(lat, n, sizeof(long), cmp_long);
+    for(long i = 0; i < n; i++){
+        sum += lat[i];
+    }
+
+    printf("%s loop, %d connections, %ld keys, alpha %.2f, %.1f s\n",
+        rate > 0 ? "open" : "closed", nconns, nkeys, alpha, elapsed);
+    printf("    %ld requests, %.0f requests/sec, %.1f MB/s, %ld errors, %ld timeouts\n",
+        n, n / elapsed, bytes / elapsed / 1e6, errors, timeouts);
+    printf("    per connection: min %ld mean %.1f max %ld requests, %d with none\n",
+        least, (double)n / nconns, most, starved);
+    printf("    latency us: mean %.0f p50 %ld p99 %ld p999 %ld max %ld\n",
+        n ? (double)sum / n : 0.0, quantile(lat, n, 0.5), quantile(lat, n, 0.99),
+        quantile(lat, n, 0.999), n ? lat[n - 1] : 0);
+    /* requests still in flight at the end may reach the origin uncounted */
+    printf("    hit ratio %.3f, byte hit ratio %.3f (%lu requests reached the origin)\n",
+        n ? 1 - (double)origin_reqs / n : 0.0,
+        bytes ? 1 - (double)origin_bytes / bytes : 0.0, origin_reqs);
+    return errors > 0 || timeouts > 0;
+}